@@ -1,11 +1,22 @@
 #include <aarch64/intrinsic.h>
 
+// Shorter waits cost less spinning than a switch away and back
+#define DELAY_SLEEP_MIN_US 100
+
+WEAK void delay_sleep(u64 deadline)
+{
+    (void)deadline;
+}
+
 void delay_us(u64 n)
 {
     u64 freq = get_clock_frequency();
     u64 end = get_timestamp(), now;
     end += freq / 1000000 * n;
 
+    if (n >= DELAY_SLEEP_MIN_US) {
+        delay_sleep(end);
+    }
     do {
         now = get_timestamp();
     } while (now <= end);
@@ -13,7 +24,7 @@ void delay_us(u64 n)
 
 void smp_init()
 {
-    psci_cpu_on(1, SECONDARY_CORE_ENTRY);
-    psci_cpu_on(2, SECONDARY_CORE_ENTRY);
-    psci_cpu_on(3, SECONDARY_CORE_ENTRY);
+    for (u64 i = 1; i < NCPU; i++) {
+        psci_cpu_on(i, SECONDARY_CORE_ENTRY);
+    }
 }
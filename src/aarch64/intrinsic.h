@@ -2,6 +2,9 @@
 
 #include <common/defines.h>
 
+// NCPU, the number of CPUs, is set by the build, which also hands it to
+// the linker script
+
 #define SECONDARY_CORE_ENTRY 0x40000000
 #define PSCI_SYSTEM_OFF 0x84000008
 #define PSCI_SYSTEM_RESET 0x84000009
@@ -76,6 +79,18 @@ static ALWAYS_INLINE u64 get_timestamp()
     return result;
 }
 
+/* EL1 physical timer: fires once the counter reaches `ticks`. */
+static ALWAYS_INLINE void arch_set_cntp_cval(u64 ticks)
+{
+    asm volatile("msr cntp_cval_el0, %[x]" : : [x] "r"(ticks));
+}
+
+/* Bit 0 enables the timer, bit 1 masks its interrupt. */
+static ALWAYS_INLINE void arch_set_cntp_ctl(u64 ctl)
+{
+    asm volatile("msr cntp_ctl_el0, %[x]\n\tisb" : : [x] "r"(ctl));
+}
+
 /* Instruction synchronization barrier. */
 static ALWAYS_INLINE void arch_isb()
 {
@@ -88,6 +103,12 @@ static ALWAYS_INLINE void arch_dsb_sy()
     asm volatile("dsb sy" ::: "memory");
 }
 
+/* Wait until earlier stores are visible in the inner shareable domain. */
+static ALWAYS_INLINE void arch_dsb_ishst()
+{
+    asm volatile("dsb ishst" ::: "memory");
+}
+
 static ALWAYS_INLINE void arch_fence()
 {
     arch_dsb_sy();
@@ -168,6 +189,65 @@ static ALWAYS_INLINE void arch_set_ttbr0(u64 addr)
     arch_tlbi_vmalle1is();
 }
 
+/**
+ * Targeted TLB invalidation, broadcast to all CPUs in the inner shareable
+ * domain. Page table stores must be made visible with arch_tlbi_prepare()
+ * before, and a batch of invalidations completed with arch_tlbi_sync()
+ * after.
+ */
+static ALWAYS_INLINE void arch_tlbi_prepare()
+{
+    asm volatile("dsb ishst" ::: "memory");
+}
+
+static ALWAYS_INLINE void arch_tlbi_sync()
+{
+    asm volatile("dsb ish\n\tisb" ::: "memory");
+}
+
+/* Invalidate the entries of the page at `va`, tagged with `asid`. */
+static ALWAYS_INLINE void arch_tlbi_vae1is(u64 va, u64 asid)
+{
+    asm volatile("tlbi vae1is, %[x]"
+                 :
+                 : [x] "r"((asid << 48) | ((va >> 12) & 0xFFFFFFFFFFFull)));
+}
+
+/* Invalidate all entries tagged with `asid`. */
+static ALWAYS_INLINE void arch_tlbi_aside1is(u64 asid)
+{
+    asm volatile("tlbi aside1is, %[x]" : : [x] "r"(asid << 48));
+}
+
+/* Whether TLBI by range (FEAT_TLBIRANGE) is implemented. */
+static inline bool arch_has_tlbi_range()
+{
+    u64 isar0;
+    asm volatile("mrs %[x], id_aa64isar0_el1" : [x] "=r"(isar0));
+    return ((isar0 >> 56) & 0xf) >= 2;
+}
+
+/**
+ * Invalidate the entries of 2 * (num + 1) pages from `va`, tagged with
+ * `asid`. `num` must be below 32. Encoded as a sys instruction, since the
+ * assembler may not know `tlbi rvae1is`.
+ */
+static ALWAYS_INLINE void arch_tlbi_rvae1is(u64 va, u64 asid, u64 num)
+{
+    u64 arg = (asid << 48) | (1ull << 46) /* TG: 4KB */ | (num << 39) |
+              ((va >> 12) & 0x1FFFFFFFFFull);
+    asm volatile("sys #0, c8, c2, #1, %[x]" : : [x] "r"(arg));
+}
+
+/* Set Translation Table Base Register 0 (EL1) along with its ASID. Entries
+ * of other ASIDs stay valid, so the TLB is not flushed. */
+static ALWAYS_INLINE void arch_set_ttbr0_asid(u64 addr, u64 asid)
+{
+    arch_fence();
+    asm volatile("msr ttbr0_el1, %[x]" : : [x] "r"(addr | (asid << 48)));
+    arch_isb();
+}
+
 /* Get Translation Table Base Register 0 (EL1). */
 static inline u64 arch_get_ttbr0()
 {
@@ -262,6 +342,13 @@ static ALWAYS_INLINE void arch_yield()
     asm volatile("yield" ::: "memory");
 }
 
+static ALWAYS_INLINE u64 arch_get_daif()
+{
+    u64 t;
+    asm volatile("mrs %[x], daif" : [x] "=r"(t));
+    return t;
+}
+
 static inline bool _arch_enable_trap()
 {
     u64 t;
@@ -297,6 +384,12 @@ static ALWAYS_INLINE NO_RETURN void arch_stop_cpu()
      ((volatile u64 *)__builtin_frame_address(0))[1] = (u64)(addr), \
      compiler_fence())
 
+// Wait for `n` microseconds. Long waits sleep through delay_sleep() when
+// the caller is a thread that may, short ones spin.
 void delay_us(u64 n);
+// Sleep until get_timestamp() reaches `deadline`, or return right away if
+// the caller cannot sleep. This default always returns; the scheduler
+// overrides it.
+void delay_sleep(u64 deadline);
 u64 psci_cpu_on(u64 cpuid, u64 ep);
 void smp_init();
\ No newline at end of file
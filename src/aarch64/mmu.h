@@ -17,6 +17,8 @@ typedef unsigned long long u64;
 #define SH_INNER (3 << 8)
 
 #define AF_USED (1 << 10)
+// Not global: the TLB entry is tagged with the current ASID
+#define PTE_NG (1 << 11)
 
 #define PTE_NORMAL_NC ((MT_NORMAL_NC << 2) | AF_USED | SH_OUTER)
 #define PTE_NORMAL ((MT_NORMAL << 2) | AF_USED | SH_OUTER)
@@ -35,11 +37,13 @@ typedef unsigned long long u64;
 
 #define PTE_KERNEL_DATA (PTE_KERNEL | PTE_NORMAL | PTE_BLOCK)
 #define PTE_KERNEL_DEVICE (PTE_KERNEL | PTE_DEVICE | PTE_BLOCK)
-#define PTE_USER_DATA (PTE_USER | PTE_NORMAL | PTE_PAGE)
+#define PTE_USER_DATA (PTE_USER | PTE_NORMAL | PTE_PAGE | PTE_NG)
 
 #define N_PTE_PER_TABLE 512
 
 #define PTE_HIGH_NX (1LL << 54)
+// Software bit: read-only because the page is shared copy-on-write
+#define PTE_COW (1LL << 55)
 
 #define KSPACE_MASK 0xFFFF000000000000
 
@@ -64,3 +68,29 @@ typedef PTEntry *PTEntriesPtr;
 #define PTE_FLAGS(pte) ((pte) & 0xFFFF000000000FFF)
 #define P2N(addr) (addr >> 12)
 #define PAGE_BASE(addr) ((u64)addr & ~(PAGE_SIZE - 1))
+
+// Index of `va` in the table of each level
+#define VA_PART0(va) (((u64)(va) >> 39) & 0x1FF)
+#define VA_PART1(va) (((u64)(va) >> 30) & 0x1FF)
+#define VA_PART2(va) (((u64)(va) >> 21) & 0x1FF)
+#define VA_PART3(va) (((u64)(va) >> 12) & 0x1FF)
+
+// Allocates a page for a page table, which need not be zeroed
+typedef void *(*PTAlloc)();
+
+// Map [va, va + size) to [pa, pa + size) under the level-0 table `pt`,
+// using the largest blocks (1GB, 2MB or 4KB) that alignment allows. `attr`
+// holds the descriptor attributes without the type bits. Returns false if
+// a table cannot be allocated or an existing block is in the way.
+bool pt_map_range(PTEntriesPtr pt, u64 va, u64 pa, u64 size, u64 attr,
+                  PTAlloc alloc);
+
+// Build the kernel linear map up to `phys_top` and switch to it. Tables
+// come from `alloc`, as this runs before the page allocator is up. Returns
+// false, still on the boot table, if a table cannot be allocated.
+bool kernel_pt_init(u64 phys_top, PTAlloc alloc);
+// Switch the calling CPU to the kernel linear map
+void kernel_pt_install();
+
+// Installed in TTBR0 while no user address space is attached
+extern PTEntries kernel_pt_empty;
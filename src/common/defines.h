@@ -45,6 +45,19 @@ typedef u64 usize;
 #define ALWAYS_INLINE inline __attribute__((unused, always_inline))
 #define NO_INLINE __attribute__((noinline))
 #define NO_IPA __attribute__((noipa))
+#define WEAK __attribute__((weak))
+
+#define CACHE_LINE_SIZE 64
+// Start on a cache line of its own, so that writes to it do not invalidate
+// unrelated data on the other CPUs. On a type, also pads the size to whole
+// lines; on a variable, only the start is aligned, so every independently
+// written neighbour needs it too. Build with NO_CACHELINE_PADDING to measure
+// the difference.
+#ifndef NO_CACHELINE_PADDING
+#define CACHELINE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+#else
+#define CACHELINE_ALIGNED
+#endif
 
 // NOTE: no_return will disable traps.
 // NO_RETURN NO_INLINE void no_return();
@@ -51,7 +51,14 @@ ListNode *_detach_from_list(ListNode *node);
         __t;                                     \
     })
 
-// Lockfree Queue: implemented as a lock-free single linked list.
+// Lockfree Queue: implemented as a lock-free single linked list. It is a
+// LIFO stack, not a queue; use common/ring.h where order matters.
+//
+// fetch_from_queue() suffers from ABA when several CPUs fetch: one may read
+// `head` and `head->next`, stall while the node is fetched, freed and added
+// again, and then succeed with a stale `next`. It is only safe with a single
+// fetching CPU. add_to_queue() and fetch_all_from_queue() are always safe,
+// which is all the remote-free queues in kernel/mem.c use.
 typedef struct QueueNode {
     struct QueueNode *next;
 } QueueNode;
@@ -0,0 +1,102 @@
+#include <common/ring.h>
+
+void init_mpmc_ring(MPMCRing *ring, MPMCSlot *slots, u64 size)
+{
+    ring->slots = slots;
+    ring->mask = size - 1;
+    for (u64 i = 0; i < size; i++) {
+        slots[i].seq = i;
+    }
+    ring->tail = ring->head = 0;
+}
+
+bool mpmc_ring_push(MPMCRing *ring, void *data)
+{
+    u64 pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    MPMCSlot *slot;
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        u64 seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        i64 diff = (i64)(seq - pos);
+        if (diff == 0) {
+            // The slot is free in this lap, claim it
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Still holds an element of the previous lap
+            return false;
+        } else {
+            // Another producer claimed it
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->data = data;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool mpmc_ring_pop(MPMCRing *ring, void **data)
+{
+    u64 pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    MPMCSlot *slot;
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        u64 seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        i64 diff = (i64)(seq - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Not filled yet
+            return false;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+    *data = slot->data;
+    // Free for the producers of the next lap
+    __atomic_store_n(&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void init_spsc_ring(SPSCRing *ring, void **data, u64 size)
+{
+    ring->data = data;
+    ring->mask = size - 1;
+    ring->tail = ring->head = 0;
+    ring->cached_head = ring->cached_tail = 0;
+}
+
+bool spsc_ring_push(SPSCRing *ring, void *data)
+{
+    u64 tail = ring->tail;
+    if (tail - ring->cached_head > ring->mask) {
+        ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->cached_head > ring->mask) {
+            return false;
+        }
+    }
+    ring->data[tail & ring->mask] = data;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool spsc_ring_pop(SPSCRing *ring, void **data)
+{
+    u64 head = ring->head;
+    if (head == ring->cached_tail) {
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head == ring->cached_tail) {
+            return false;
+        }
+    }
+    *data = ring->data[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <common/defines.h>
+
+// Bounded lock-free rings of pointers. The caller provides the storage,
+// whose size must be a power of two. Unlike the QueueNode stack in
+// common/list.h, they are FIFO and never dereference an element, so freeing
+// and reusing what was popped is safe.
+
+// Multi-producer multi-consumer ring (Vyukov). Each slot carries a sequence
+// number telling whether it is ready for the producer or the consumer of a
+// given lap, so a position is claimed with a single CAS and stale claims
+// from an earlier lap cannot succeed.
+typedef struct {
+    volatile u64 seq;
+    void *data;
+} MPMCSlot;
+
+typedef struct {
+    MPMCSlot *slots;
+    u64 mask;
+    // Producers and consumers each keep to their own cache line
+    volatile u64 tail CACHELINE_ALIGNED;
+    volatile u64 head CACHELINE_ALIGNED;
+} MPMCRing;
+
+void init_mpmc_ring(MPMCRing *ring, MPMCSlot *slots, u64 size);
+// Returns false if the ring is full
+bool mpmc_ring_push(MPMCRing *ring, void *data);
+// Returns false if the ring is empty
+bool mpmc_ring_pop(MPMCRing *ring, void **data);
+
+// Single-producer single-consumer ring, e.g. a per-CPU mailbox fed by one
+// other CPU. Each side caches the other's index and only rereads it when
+// the ring looks full or empty.
+typedef struct {
+    void **data;
+    u64 mask;
+    // Written by the producer
+    volatile u64 tail CACHELINE_ALIGNED;
+    u64 cached_head;
+    // Written by the consumer
+    volatile u64 head CACHELINE_ALIGNED;
+    u64 cached_tail;
+} SPSCRing;
+
+void init_spsc_ring(SPSCRing *ring, void **data, u64 size);
+bool spsc_ring_push(SPSCRing *ring, void *data);
+bool spsc_ring_pop(SPSCRing *ring, void **data);
@@ -0,0 +1,82 @@
+#include <aarch64/intrinsic.h>
+#include <common/rwlock.h>
+#include <common/spinlock.h>
+
+void init_rwlock(RWLock *lock)
+{
+    lock->state = 0;
+}
+
+// Interrupts stay off while the lock is held, as with SpinLock
+bool try_acquire_rwlock_read(RWLock *lock)
+{
+    push_off();
+    u32 state = lock->state;
+    if (!(state & (RWLOCK_WRITER | RWLOCK_WAITING)) &&
+        __atomic_compare_exchange_n(&lock->state, &state,
+                                    state + RWLOCK_READER, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return true;
+    }
+    pop_off();
+    return false;
+}
+
+void acquire_rwlock_read(RWLock *lock)
+{
+    while (!try_acquire_rwlock_read(lock)) {
+        // Woken by the writer releasing
+        if (lock->state & (RWLOCK_WRITER | RWLOCK_WAITING))
+            arch_wfe();
+    }
+}
+
+void release_rwlock_read(RWLock *lock)
+{
+    u32 state = __atomic_sub_fetch(&lock->state, RWLOCK_READER,
+                                   __ATOMIC_RELEASE);
+    // The last reader out lets a waiting writer in
+    if (state == RWLOCK_WAITING) {
+        arch_dsb_ishst();
+        arch_sev();
+    }
+    pop_off();
+}
+
+bool try_acquire_rwlock_write(RWLock *lock)
+{
+    // A waiting writer may take it, even if it was not the one waiting
+    push_off();
+    u32 state = lock->state;
+    if (!(state & ~RWLOCK_WAITING) &&
+        __atomic_compare_exchange_n(&lock->state, &state, RWLOCK_WRITER,
+                                    false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+        return true;
+    }
+    pop_off();
+    return false;
+}
+
+void acquire_rwlock_write(RWLock *lock)
+{
+    while (!try_acquire_rwlock_write(lock)) {
+        u32 state = lock->state;
+        if (!(state & RWLOCK_WAITING)) {
+            // Taking the lock clears the flag, so every waiting writer sets
+            // it again. Look once more before sleeping: the holder may have
+            // left before seeing the flag.
+            __atomic_fetch_or(&lock->state, RWLOCK_WAITING, __ATOMIC_RELAXED);
+        } else if (state & ~RWLOCK_WAITING) {
+            arch_wfe();
+        }
+    }
+}
+
+void release_rwlock_write(RWLock *lock)
+{
+    __atomic_fetch_and(&lock->state, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+    arch_dsb_ishst();
+    arch_sev();
+    pop_off();
+}
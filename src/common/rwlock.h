@@ -0,0 +1,23 @@
+#pragma once
+
+#include <common/defines.h>
+#include <aarch64/intrinsic.h>
+
+// Reader-writer spinlock. Any number of readers, or one writer. A waiting
+// writer holds off new readers, so writers are not starved.
+typedef struct {
+    // RWLOCK_WRITER | RWLOCK_WAITING | readers * RWLOCK_READER
+    volatile u32 state;
+} RWLock;
+
+#define RWLOCK_WRITER 1u
+#define RWLOCK_WAITING 2u
+#define RWLOCK_READER 4u
+
+void init_rwlock(RWLock *);
+bool try_acquire_rwlock_read(RWLock *);
+void acquire_rwlock_read(RWLock *);
+void release_rwlock_read(RWLock *);
+bool try_acquire_rwlock_write(RWLock *);
+void acquire_rwlock_write(RWLock *);
+void release_rwlock_write(RWLock *);
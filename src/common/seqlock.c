@@ -0,0 +1,37 @@
+#include <aarch64/intrinsic.h>
+#include <common/seqlock.h>
+
+void init_seqlock(SeqLock *lock)
+{
+    lock->seq = 0;
+    init_spinlock(&lock->lock);
+}
+
+void write_seqlock(SeqLock *lock)
+{
+    acquire_spinlock(&lock->lock);
+    __atomic_store_n(&lock->seq, lock->seq + 1, __ATOMIC_RELAXED);
+    // The odd number must be visible before any of the data changes
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void write_sequnlock(SeqLock *lock)
+{
+    __atomic_store_n(&lock->seq, lock->seq + 1, __ATOMIC_RELEASE);
+    release_spinlock(&lock->lock);
+}
+
+u32 read_seqbegin(SeqLock *lock)
+{
+    u32 seq;
+    while ((seq = __atomic_load_n(&lock->seq, __ATOMIC_ACQUIRE)) & 1)
+        arch_yield();
+    return seq;
+}
+
+bool read_seqretry(SeqLock *lock, u32 seq)
+{
+    // The data must be read before the sequence number is checked again
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&lock->seq, __ATOMIC_RELAXED) != seq;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <common/defines.h>
+#include <common/spinlock.h>
+
+// Sequence lock for small, read-mostly data. Writers bump the sequence
+// number around their update; readers never write to the lock and retry if
+// it moved:
+//
+//     u32 seq;
+//     do {
+//         seq = read_seqbegin(&lock);
+//         copy = data;
+//     } while (read_seqretry(&lock, seq));
+//
+// Readers may see a torn copy before the retry, so they must not follow
+// pointers out of it.
+typedef struct {
+    // Odd while a writer is updating
+    volatile u32 seq;
+    // Serialises writers
+    SpinLock lock;
+} SeqLock;
+
+void init_seqlock(SeqLock *);
+void write_seqlock(SeqLock *);
+void write_sequnlock(SeqLock *);
+u32 read_seqbegin(SeqLock *);
+bool read_seqretry(SeqLock *, u32 seq);
@@ -3,26 +3,40 @@
 
 void init_spinlock(SpinLock *lock)
 {
-    lock->locked = 0;
+    lock->next = 0;
+    lock->owner = 0;
 }
 
 bool try_acquire_spinlock(SpinLock *lock)
 {
-    if (!lock->locked &&
-        !__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE)) {
+    // Only the holder moves `owner`, so while no one holds the lock it stays
+    // put and taking the next ticket is enough.
+    push_off();
+    u32 owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+    if (lock->next == owner &&
+        __atomic_compare_exchange_n(&lock->next, &owner, owner + 1, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
         return true;
-    } else {
-        return false;
     }
+    pop_off();
+    return false;
 }
 
 void acquire_spinlock(SpinLock *lock)
 {
-    while (!try_acquire_spinlock(lock))
-        arch_yield();
+    push_off();
+    u32 ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    // Sleep until release_spinlock() signals. A signal sent between the
+    // check and the wfe leaves the event register set, so it is not lost.
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+        arch_wfe();
 }
 
 void release_spinlock(SpinLock *lock)
 {
-    __atomic_clear(&lock->locked, __ATOMIC_RELEASE);
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+    // The new owner must see the store when it wakes up
+    arch_dsb_ishst();
+    arch_sev();
+    pop_off();
 }
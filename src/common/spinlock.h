@@ -3,10 +3,28 @@
 #include <common/defines.h>
 #include <aarch64/intrinsic.h>
 
+// Ticket lock: CPUs get the lock in the order they asked for it.
 typedef struct {
-    volatile bool locked;
+    // Next ticket to hand out
+    volatile u32 next;
+    // Ticket of the holder
+    volatile u32 owner;
 } SpinLock;
 
+// Disable interrupts on the calling CPU, nestable. pop_off() turns them
+// back on when the outermost push_off() found them on. Spinlocks do this
+// themselves, so that an interrupt handler never spins on a lock its own
+// CPU holds, and holders are not preempted.
+//
+// The nesting state is per CPU, so these four are provided by the kernel,
+// see kernel/trap.c.
+void push_off();
+void pop_off();
+// Whether interrupts go back on at the outermost pop_off(). The scheduler
+// keeps it per thread across a switch.
+bool get_intena();
+void set_intena(bool intena);
+
 void init_spinlock(SpinLock *);
 bool try_acquire_spinlock(SpinLock *);
 void acquire_spinlock(SpinLock *);
@@ -0,0 +1,34 @@
+#include <aarch64/intrinsic.h>
+#include <driver/clock.h>
+#include <driver/gicv3.h>
+#include <driver/interrupt.h>
+
+static ClockHandler clock_handler;
+
+static void clock_interrupt()
+{
+    // Quiet until re-armed, so the handler runs once per expiry
+    arch_set_cntp_ctl(2);
+    if (clock_handler) {
+        clock_handler();
+    }
+}
+
+void init_clock(ClockHandler handler)
+{
+    clock_handler = handler;
+    set_interrupt_handler(TIMER_IRQ, clock_interrupt);
+    arch_set_cntp_ctl(2);
+    gicv3_enable_ppi(TIMER_IRQ);
+}
+
+void set_clock_deadline(u64 deadline)
+{
+    arch_set_cntp_cval(deadline);
+    arch_set_cntp_ctl(1);
+}
+
+void stop_clock()
+{
+    arch_set_cntp_ctl(0);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <common/defines.h>
+
+// EL1 physical timer, PPI 14
+#define TIMER_IRQ 30
+
+typedef void (*ClockHandler)();
+
+// Route the timer interrupt of the calling CPU to `handler`
+void init_clock(ClockHandler handler);
+// Fire once when get_timestamp() reaches `deadline`, at once if it already
+// has. The handler programs the next deadline, if any.
+void set_clock_deadline(u64 deadline);
+// Cancel the deadline of the calling CPU
+void stop_clock();
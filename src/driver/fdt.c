@@ -0,0 +1,109 @@
+#include <common/string.h>
+#include <driver/fdt.h>
+
+// Reference: https://devicetree-specification.readthedocs.io/en/stable/flattened-format.html
+
+#define FDT_MAGIC 0xd00dfeed
+
+#define FDT_BEGIN_NODE 0x1
+#define FDT_END_NODE 0x2
+#define FDT_PROP 0x3
+#define FDT_NOP 0x4
+#define FDT_END 0x9
+
+// All fields are big-endian
+struct fdt_header {
+    u32 magic;
+    u32 totalsize;
+    u32 off_dt_struct;
+    u32 off_dt_strings;
+    u32 off_mem_rsvmap;
+    u32 version;
+    u32 last_comp_version;
+    u32 boot_cpuid_phys;
+    u32 size_dt_strings;
+    u32 size_dt_struct;
+};
+
+static u32 be32(const void *p)
+{
+    const u8 *b = p;
+    return ((u32)b[0] << 24) | ((u32)b[1] << 16) | ((u32)b[2] << 8) | b[3];
+}
+
+// Read a number made of `cells` 32-bit cells
+static u64 read_cells(const char *p, u32 cells)
+{
+    u64 value = 0;
+    for (u32 i = 0; i < cells; i++) {
+        value = (value << 32) | be32(p + 4 * i);
+    }
+    return value;
+}
+
+static bool is_memory_node(const char *name)
+{
+    return !strncmp(name, "memory", 6) && (name[6] == '\0' || name[6] == '@');
+}
+
+bool fdt_find_memory(const void *fdt, u64 *base, u64 *size)
+{
+    const struct fdt_header *header = fdt;
+    if (be32(&header->magic) != FDT_MAGIC) {
+        return false;
+    }
+
+    const char *structs = (const char *)fdt + be32(&header->off_dt_struct);
+    const char *strings = (const char *)fdt + be32(&header->off_dt_strings);
+    u32 len = be32(&header->size_dt_struct);
+
+    // Defaults of the root node, as per the specification
+    u32 address_cells = 2, size_cells = 1;
+    int depth = 0;
+    bool in_memory = false;
+
+    u32 off = 0;
+    while (off + 4 <= len) {
+        u32 token = be32(structs + off);
+        off += 4;
+
+        switch (token) {
+        case FDT_BEGIN_NODE: {
+            const char *name = structs + off;
+            depth++;
+            // The root node is at depth 1, /memory is one of its children
+            in_memory = depth == 2 && is_memory_node(name);
+            off += round_up(strlen(name) + 1, 4);
+            break;
+        }
+        case FDT_END_NODE:
+            depth--;
+            in_memory = false;
+            break;
+        case FDT_PROP: {
+            u32 prop_len = be32(structs + off);
+            const char *name = strings + be32(structs + off + 4);
+            const char *value = structs + off + 8;
+            off += 8 + round_up(prop_len, 4);
+
+            if (depth == 1 && !strncmp(name, "#address-cells", 15)) {
+                address_cells = be32(value);
+            } else if (depth == 1 && !strncmp(name, "#size-cells", 12)) {
+                size_cells = be32(value);
+            } else if (in_memory && !strncmp(name, "reg", 4) &&
+                       prop_len >= 4 * (address_cells + size_cells)) {
+                *base = read_cells(value, address_cells);
+                *size = read_cells(value + 4 * address_cells, size_cells);
+                return true;
+            }
+            break;
+        }
+        case FDT_NOP:
+            break;
+        default:
+            // FDT_END, or a broken tree
+            return false;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <common/defines.h>
+
+// Find the first range of the /memory node in the flattened device tree at
+// `fdt`. Returns false if `fdt` is not a valid device tree or has no memory
+// node.
+bool fdt_find_memory(const void *fdt, u64 *base, u64 *size);
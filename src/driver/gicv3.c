@@ -0,0 +1,93 @@
+#include <aarch64/intrinsic.h>
+#include <driver/gicv3.h>
+
+// Redistributor frame of the calling CPU
+static u64 rd_base()
+{
+    u64 mpidr;
+    asm volatile("mrs %[x], mpidr_el1" : [x] "=r"(mpidr));
+    // Affinity as laid out in GICR_TYPER[63:32]
+    u64 aff = (mpidr & 0xffffff) | ((mpidr >> 32 & 0xff) << 24);
+
+    for (u64 rd = GICR_BASE;; rd += GICR_STRIDE) {
+        u64 typer = device_get_u32(rd + GICR_TYPER) |
+                    (u64)device_get_u32(rd + GICR_TYPER + 4) << 32;
+        if (typer >> 32 == aff) {
+            return rd;
+        }
+        if (typer & GICR_TYPER_LAST) {
+            return 0;
+        }
+    }
+}
+
+void gicv3_init()
+{
+    device_put_u32(GICD_BASE + GICD_CTLR, 0);
+    while (device_get_u32(GICD_BASE + GICD_CTLR) & GICD_CTLR_RWP)
+        ;
+    // Affinity routing, with every interrupt in group 1
+    device_put_u32(GICD_BASE + GICD_CTLR,
+                   GICD_CTLR_ARE | GICD_CTLR_ENABLE_G1 | GICD_CTLR_ENABLE_G0);
+    while (device_get_u32(GICD_BASE + GICD_CTLR) & GICD_CTLR_RWP)
+        ;
+}
+
+void gicv3_init_percpu()
+{
+    u64 rd = rd_base();
+    if (!rd) {
+        return;
+    }
+
+    // Wake the redistributor up
+    device_put_u32(rd + GICR_WAKER, device_get_u32(rd + GICR_WAKER) &
+                                            ~GICR_WAKER_PROCESSOR_SLEEP);
+    while (device_get_u32(rd + GICR_WAKER) & GICR_WAKER_CHILDREN_ASLEEP)
+        ;
+
+    u64 sgi = rd + GICR_SGI_OFFSET;
+    device_put_u32(sgi + GICR_ICENABLER0, 0xffffffff);
+    device_put_u32(sgi + GICR_IGROUPR0, 0xffffffff);
+
+    // CPU interface: system registers, no priority masking, group 1 on
+    u64 sre;
+    asm volatile("mrs %[x], icc_sre_el1" : [x] "=r"(sre));
+    asm volatile("msr icc_sre_el1, %[x]\n\tisb" : : [x] "r"(sre | 1));
+    asm volatile("msr icc_pmr_el1, %[x]" : : [x] "r"(0xffull));
+    asm volatile("msr icc_bpr1_el1, %[x]" : : [x] "r"(0ull));
+    asm volatile("msr icc_igrpen1_el1, %[x]\n\tisb" : : [x] "r"(1ull));
+}
+
+void gicv3_enable_ppi(u32 intid)
+{
+    u64 sgi = rd_base() + GICR_SGI_OFFSET;
+    // Priorities are byte-sized, four to a register
+    u64 reg = sgi + GICR_IPRIORITYR + (intid & ~3u);
+    u32 shift = (intid & 3) * 8;
+    u32 prio = device_get_u32(reg);
+    device_put_u32(reg, (prio & ~(0xffu << shift)) | (0xa0u << shift));
+    device_put_u32(sgi + GICR_ISENABLER0, 1u << intid);
+}
+
+void gicv3_send_sgi(int cpu, u32 intid)
+{
+    // QEMU numbers the CPUs by Aff0 within cluster 0, so the target list
+    // is a bitmap of CPU numbers
+    u64 sgi1r = (u64)(intid & 0xf) << 24 | 1ull << cpu;
+    arch_dsb_sy();
+    asm volatile("msr icc_sgi1r_el1, %[x]\n\tisb" : : [x] "r"(sgi1r));
+}
+
+u32 gicv3_ack()
+{
+    u64 iar;
+    asm volatile("mrs %[x], icc_iar1_el1" : [x] "=r"(iar));
+    arch_dsb_sy();
+    return iar & 0xffffff;
+}
+
+void gicv3_eoi(u32 intid)
+{
+    asm volatile("msr icc_eoir1_el1, %[x]\n\tisb" : : [x] "r"((u64)intid));
+}
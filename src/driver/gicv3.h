@@ -0,0 +1,46 @@
+#pragma once
+
+#include <common/defines.h>
+#include <driver/base.h>
+
+// GICv3 of the QEMU virt machine (-machine virt,gic-version=3)
+#define GICD_BASE P2V(0x08000000)
+#define GICR_BASE P2V(0x080A0000)
+// Each CPU has an RD frame followed by an SGI frame
+#define GICR_STRIDE 0x20000
+#define GICR_SGI_OFFSET 0x10000
+
+// Distributor
+#define GICD_CTLR 0x0000
+#define GICD_CTLR_RWP (1u << 31)
+#define GICD_CTLR_ARE (1 << 4)
+#define GICD_CTLR_ENABLE_G1 (1 << 1)
+#define GICD_CTLR_ENABLE_G0 (1 << 0)
+
+// Redistributor, RD frame
+#define GICR_TYPER 0x0008
+#define GICR_TYPER_LAST (1 << 4)
+#define GICR_WAKER 0x0014
+#define GICR_WAKER_PROCESSOR_SLEEP (1 << 1)
+#define GICR_WAKER_CHILDREN_ASLEEP (1 << 2)
+// Redistributor, SGI frame: SGIs and PPIs (INTID 0..31) of one CPU
+#define GICR_IGROUPR0 0x0080
+#define GICR_ISENABLER0 0x0100
+#define GICR_ICENABLER0 0x0180
+#define GICR_IPRIORITYR 0x0400
+
+// INTIDs from 1020 up are special, e.g. 1023 when nothing is pending
+#define GIC_SPURIOUS 1020
+
+// Set up the distributor, once on CPU 0
+void gicv3_init();
+// Set up the redistributor and CPU interface of the calling CPU
+void gicv3_init_percpu();
+// Enable the private interrupt `intid` (SGI 0..15 or PPI 16..31) on the
+// calling CPU
+void gicv3_enable_ppi(u32 intid);
+// Raise SGI `intid` (0..15) on CPU `cpu`
+void gicv3_send_sgi(int cpu, u32 intid);
+// Acknowledge the highest priority pending interrupt and return its INTID
+u32 gicv3_ack();
+void gicv3_eoi(u32 intid);
@@ -0,0 +1,31 @@
+#include <aarch64/intrinsic.h>
+#include <driver/gicv3.h>
+#include <driver/interrupt.h>
+#include <kernel/printk.h>
+
+static InterruptHandler handlers[NR_INTERRUPTS];
+
+void set_interrupt_handler(u32 intid, InterruptHandler handler)
+{
+    if (intid >= NR_INTERRUPTS) {
+        printk("PANIC: interrupt %d out of range\n", intid);
+        return;
+    }
+    handlers[intid] = handler;
+}
+
+void interrupt_global_handler()
+{
+    for (;;) {
+        u32 intid = gicv3_ack();
+        if (intid >= GIC_SPURIOUS) {
+            return;
+        }
+        if (intid < NR_INTERRUPTS && handlers[intid]) {
+            handlers[intid]();
+        } else {
+            printk("PANIC: CPU %lld: unexpected interrupt %d\n", cpuid(), intid);
+        }
+        gicv3_eoi(intid);
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <common/defines.h>
+
+// SGIs, PPIs and the first SPIs
+#define NR_INTERRUPTS 256
+
+typedef void (*InterruptHandler)();
+
+void set_interrupt_handler(u32 intid, InterruptHandler handler);
+// Run the handlers of the pending interrupts, called on IRQ exceptions
+void interrupt_global_handler();
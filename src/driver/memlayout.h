@@ -1,7 +1,17 @@
 #pragma once
 
+#include <common/defines.h>
+
 #define EXTMEM 0x40000000
-#define PHYSTOP 0x80000000
+
+// Amount of RAM assumed when the boot loader passes no device tree. The
+// build sets it to the size QEMU is started with.
+#ifndef RAM_SIZE_MB
+#define RAM_SIZE_MB 1024
+#endif
+
+// End of RAM, found at boot by init_pages()
+extern u64 phys_top;
 
 #define KSPACE_MASK 0xFFFF000000000000
 #define KERNLINK (KSPACE_MASK + EXTMEM) /* Address where kernel is linked */
@@ -1,7 +1,24 @@
 #include <aarch64/intrinsic.h>
+#include <kernel/sched.h>
 #include <test/test.h>
 
+// The tests that need threads, in a thread of their own
+static void thread_tests(u64 arg) {
+    (void)arg;
+    sched_test();
+    timer_test();
+}
+
 NO_RETURN void idle_entry() {
     kalloc_test();
-    arch_stop_cpu();
+    lock_test();
+    rwlock_test();
+    ring_test();
+    // The tests above run before the timer is on
+    if (cpuid() == 0) {
+        alloc_test();
+        vm_test();
+        create_thread(thread_tests, 0);
+    }
+    sched_start();
 }
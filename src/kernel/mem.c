@@ -1,8 +1,11 @@
+#include <aarch64/intrinsic.h>
 #include <aarch64/mmu.h>
-#include <common/rc.h>
+#include <common/list.h>
 #include <common/spinlock.h>
+#include <driver/fdt.h>
 #include <driver/memlayout.h>
 #include <kernel/mem.h>
+#include <kernel/percpu.h>
 #include <kernel/printk.h>
 
 // Reference: https://stackoverflow.com/questions/4840410/how-to-align-a-pointer-in-c
@@ -11,261 +14,1182 @@
 
 #define MIN_SIZE 8
 
-RefCount kalloc_page_cnt;
-static SpinLock page_lock, block_lock;
+static SpinLock page_lock CACHELINE_ALIGNED;
 
 extern char end[];
 static char *heap_base;
 
-// Block sizes, in bytes
-const int block_sizes[] = { 8, 16, 32, 64, 128, 256, 512, 1024, 2048 };
+u64 phys_top;
+// Device tree passed by the boot loader, saved in start.S
+extern u64 boot_dtb;
 
-typedef struct __page_header {
-    struct __page_header *next, *prev;
-    int filled_blocks;
-    // u16 id;
-    int tier;
+// Block sizes, in bytes. Up to 64 they step by 8, so a request loses less
+// than 8 bytes to rounding. From 64 to 768 four classes per doubling keep
+// the loss under 20%. Above that the classes follow how many blocks fit in
+// a page (4 x 1024, 3 x 1360 = 4080, 2 x 2048). Finer classes there would
+// not fit more blocks per page, so the loss per request goes up to 25%
+// (769 bytes get 1024) and 33% (1361 bytes get 2048).
+const int block_sizes[] = { 8,   16,  24,  32,  40,  48,   56,   64,  80,
+                            96,  112, 128, 160, 192, 224,  256,  320, 384,
+                            448, 512, 640, 768, 1024, 1360, 2048 };
+#define NR_TIERS (int)(sizeof(block_sizes) / sizeof(block_sizes[0]))
+#define MAX_BLOCK_SIZE 2048
+
+// Tier of every request size, indexed by (size + 7) / 8
+static u8 size_to_tier[MAX_BLOCK_SIZE / MIN_SIZE + 1];
+
+// Metadata of one physical page frame, kept out of line in `mem_map` so
+// that slab pages are all payload and any frame can be inspected without
+// touching the frame itself.
+struct page {
+    // Links on the buddy free lists, a per-CPU page cache or a partial list
+    struct page *next, *prev;
+    u8 flags;
+    // Buddy order of the block this frame heads
+    u8 order;
+    // Slab page: CPU whose partial list this page belongs to
+    u8 owner;
+    // Slab page: colour offset of the first block, in cache colour units
+    u8 colour;
+    // Slab page: number of blocks handed out
+    u16 filled_blocks;
+    // Slab page: blocks below this index have been carved at least once,
+    // the ones above are untouched
+    u16 unused;
+    // Large kalloc object: length in pages
+    u32 npages;
+    // Page from kalloc_page(): number of references, see get_page()
+    u32 refcnt;
+    // Slab page: intrusive list of recycled free blocks
     char *free_block;
-    // bool allocated;
-} page_header;
+    // Slab page: cache the blocks belong to
+    struct kmem_cache *cache;
+};
+
+#define PG_FREE 0x1 // Frame heads a free buddy block of `order` pages
+#define PG_SLAB 0x2 // Frame is split into blocks of `cache`
+#define PG_LARGE 0x4 // Frame heads a large kalloc object of `npages` pages
+
+// Indexed by PFN - base_pfn
+static struct page *mem_map;
+static usize base_pfn, nr_frames;
+// Frames from `init_pfn` on have neither a valid `mem_map` entry nor a place
+// in the frame allocator yet, see grow_pool()
+static usize init_pfn;
+
+// Free frames between `mem_map` and `phys_top` are handed out in blocks of
+// 2^order pages, aligned to their size in physical memory. The default
+// backend is a binary buddy allocator; building with KALLOC_BITMAP_BACKEND
+// tracks the frames with a hierarchical bitmap instead. Both provide
+// frames_alloc(), frames_free() and frames_init(), which must be called
+// with `page_lock` held.
+#define MAX_ORDER 11 // Orders 0..10, i.e. blocks of up to 4 MiB
+
+#ifndef KALLOC_BITMAP_BACKEND
+// Lists of free blocks, by order
+static struct page *free_area[MAX_ORDER] CACHELINE_ALIGNED;
+static usize nr_free[MAX_ORDER];
+#else
+// One bit per frame, set if the frame is free. Word `i` of `free_bits`
+// covers frames bitmap_pfn + 64 * i ...
+//
+// Above the leaves, every order has a summary of its own: bit `i` of
+// `avail[order]` says that a free block of that order starts in leaf word
+// `i`, and bit `s` of `avail_top[order]` that word `s` of `avail[order]` is
+// not zero. A lookup is then a ctz on each level. Only the top words are
+// scanned, one for every 1 GiB of RAM.
+static u64 *free_bits, *avail[MAX_ORDER], *avail_top[MAX_ORDER];
+static usize bitmap_pfn, nr_words, nr_summary, nr_top;
+static usize nr_free_frames CACHELINE_ALIGNED;
+#endif
+
+// Allocator statistics. Every counter is only written by the CPU it belongs
+// to, so no atomics are needed; kalloc_stats() sums them up.
+typedef struct {
+    // Order-0 pages through the per-CPU caches, and higher-order blocks
+    u64 page_allocs, page_frees;
+    u64 block_allocs, block_frees;
+    u64 pcp_refills, pcp_drains, steals;
+    // Pages allocated minus pages freed here. A CPU freeing what others
+    // allocated goes below zero, only the sum means anything.
+    i64 pages_in_use;
+    // Acquisitions of allocator locks that had to wait, and for how long
+    u64 lock_contended, lock_wait_ticks;
+} page_stats;
+
+typedef struct {
+    u64 allocs, frees, remote_frees;
+    // Sum of the sizes asked for, and of the slot sizes given out
+    u64 bytes_requested, bytes_allocated;
+    // Slab pages owned by this CPU, and how many of them are full or empty
+    u64 pages, full_pages, empty_pages;
+} slab_stats;
+
+static DEFINE_PER_CPU(page_stats, pstats);
+
+// An object cache: slab pages holding objects of one size. Each CPU owns
+// the pages it set up, so kmem_cache_alloc/free need no lock; objects freed
+// by other CPUs are pushed onto the owner's `remote_free` queue and
+// reclaimed lazily.
+struct kmem_cache {
+    const char *name;
+    u32 size, align;
+    // Distance between objects in a slab page, and the offset of the
+    // free-list link inside a free object. The link sits behind the object
+    // when a constructor has to keep the object itself intact.
+    u32 stride, freeptr;
+    u32 nr_objects;
+    // Slab colouring: the first object of a page is shifted by
+    // `colour * colour_unit` bytes, cycling through `nr_colours` offsets so
+    // that pages of one cache do not all compete for the same cache sets
+    u32 colour_unit, nr_colours;
+    void (*ctor)(void *);
+
+    struct {
+        // Pages that are already allocated, but still have empty blocks
+        struct page *partial_list;
+        // Pages with every block free, kept with their free chain intact so
+        // that alloc/free ping-pong does not rebuild a page every time
+        struct page *empty_list;
+        u32 nr_empty;
+        u32 colour_next;
+        slab_stats stats;
+    } CACHELINE_ALIGNED cpu[NCPU];
+
+    // All caches, for kalloc_stats()
+    ListNode node;
+};
+
+// Objects of any cache freed by other CPUs into pages owned by a CPU,
+// linked through their free-list slot
+static DEFINE_PER_CPU(QueueNode *, remote_free);
+
+// Empty pages each cache keeps per CPU before handing them back
+#define SLAB_EMPTY_MAX 2
+
+// Bumped to ask every CPU to give back its empty slab pages. A CPU compares
+// it with the generation it last saw whenever it allocates or frees.
+static volatile u64 reclaim_gen CACHELINE_ALIGNED;
+static DEFINE_PER_CPU(u64, reclaim_seen);
+
+// Caches backing kalloc, one per tier
+static struct kmem_cache kalloc_caches[NR_TIERS];
+// Cache of the caches from kmem_cache_create(), which kalloc cannot align
+// to their cache lines
+static struct kmem_cache cache_cache;
+
+static ListNode cache_list;
+static SpinLock cache_list_lock;
+
+// Take `lock`, accounting the time spent waiting for it to this CPU
+static void acquire_lock_stat(SpinLock *lock)
+{
+    if (try_acquire_spinlock(lock)) {
+        return;
+    }
+
+    u64 start = get_timestamp();
+    acquire_spinlock(lock);
+    page_stats *st = this_cpu_ptr(pstats);
+    st->lock_contended++;
+    st->lock_wait_ticks += get_timestamp() - start;
+}
+
+static INLINE usize page_to_pfn(struct page *page)
+{
+    return base_pfn + (page - mem_map);
+}
+
+static INLINE struct page *pfn_to_page(usize pfn)
+{
+    return &mem_map[pfn - base_pfn];
+}
+
+static INLINE void *page_address(struct page *page)
+{
+    return (void *)P2K(page_to_pfn(page) << 12);
+}
+
+static INLINE struct page *virt_to_page(void *addr)
+{
+    return pfn_to_page(P2N(K2P(addr)));
+}
+
+#ifndef KALLOC_BITMAP_BACKEND
+static void push_free_block(struct page *page, int order)
+{
+    page->flags = PG_FREE;
+    page->order = order;
+    nr_free[order]++;
+
+    if (free_area[order]) {
+        free_area[order]->prev = page;
+    }
+    page->prev = NULL;
+    page->next = free_area[order];
+    free_area[order] = page;
+}
+
+static void unlink_free_block(struct page *page, int order)
+{
+    page->flags &= ~PG_FREE;
+    nr_free[order]--;
 
-// List of unallocated pages
-static page_header *free_list = NULL;
-// List of pages that are already allocated, but still have empty blocks
-static page_header *partial_list[9] = { NULL };
+    if (page->prev) {
+        page->prev->next = page->next;
+    } else {
+        free_area[order] = page->next;
+    }
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+    page->next = page->prev = NULL;
+}
+
+// Take a block of 2^order pages, splitting a larger one if needed
+static struct page *frames_alloc(int order)
+{
+    int cur = order;
+    while (cur < MAX_ORDER && !free_area[cur]) {
+        cur++;
+    }
+    if (cur >= MAX_ORDER) {
+        return NULL;
+    }
+
+    struct page *page = free_area[cur];
+    unlink_free_block(page, cur);
+
+    // Give the upper halves back until the block has the wanted size
+    while (cur > order) {
+        cur--;
+        push_free_block(page + (1ull << cur), cur);
+    }
+
+    page->order = order;
+    return page;
+}
+
+// Give back a block of 2^order pages, merging it with its free buddies
+static void frames_free(struct page *page, int order)
+{
+    usize pfn = page_to_pfn(page);
+    while (order < MAX_ORDER - 1) {
+        usize buddy_pfn = pfn ^ (1ull << order);
+        if (buddy_pfn < base_pfn || buddy_pfn + (1ull << order) > base_pfn + nr_frames) {
+            break;
+        }
+
+        struct page *buddy = pfn_to_page(buddy_pfn);
+        if (!(buddy->flags & PG_FREE) || buddy->order != order) {
+            break;
+        }
+
+        unlink_free_block(buddy, order);
+        pfn &= ~(1ull << order);
+        order++;
+    }
+
+    push_free_block(pfn_to_page(pfn), order);
+}
+
+// Hand the frames [pfn, stop_pfn) to the allocator as the largest
+// naturally aligned blocks
+static void frames_init(usize pfn, usize stop_pfn)
+{
+    while (pfn < stop_pfn) {
+        int order = MAX_ORDER - 1;
+        while ((pfn & ((1ull << order) - 1)) || pfn + (1ull << order) > stop_pfn) {
+            order--;
+        }
+        push_free_block(pfn_to_page(pfn), order);
+        pfn += 1ull << order;
+    }
+}
+#else
+// Bits at the start of every aligned run of 2^i bits, for i = 0..6
+static const u64 run_align[] = {
+    ~0ull,
+    0x5555555555555555ull,
+    0x1111111111111111ull,
+    0x0101010101010101ull,
+    0x0001000100010001ull,
+    0x0000000100000001ull,
+    0x0000000000000001ull,
+};
+
+// Bits of `w` that start an aligned run of 2^order set bits
+static INLINE u64 run_starts(u64 w, int order)
+{
+    for (int shift = 1; shift < (1 << order); shift <<= 1) {
+        w &= w >> shift;
+    }
+    return w & run_align[order];
+}
+
+static INLINE u64 run_mask(int order, int pos)
+{
+    return order == 6 ? ~0ull : ((1ull << (1 << order)) - 1) << pos;
+}
+
+static INLINE bool avail_test(int order, usize i)
+{
+    return i < nr_words && (avail[order][i / 64] >> (i & 63) & 1);
+}
+
+static void avail_set(int order, usize i, bool set)
+{
+    u64 *w = &avail[order][i / 64];
+    u64 bit = 1ull << (i & 63);
+    *w = set ? *w | bit : *w & ~bit;
+    u64 *top = &avail_top[order][i / 4096];
+    bit = 1ull << (i / 64 & 63);
+    *top = *w ? *top | bit : *top & ~bit;
+}
+
+// Refresh the summaries after leaf word `i` changed
+static void update_summary(usize i)
+{
+    // Blocks of up to 64 frames lie within one word
+    for (int order = 0; order <= 6; order++) {
+        avail_set(order, i, run_starts(free_bits[i], order) != 0);
+    }
+    // Larger ones are free if both halves are
+    for (int order = 7; order < MAX_ORDER; order++) {
+        usize first = i & ~((1ull << (order - 6)) - 1);
+        usize half = 1ull << (order - 7);
+        avail_set(order, first,
+                  avail_test(order - 1, first) &&
+                          avail_test(order - 1, first + half));
+    }
+}
+
+static struct page *frames_alloc(int order)
+{
+    for (usize t = 0; t < nr_top; t++) {
+        if (!avail_top[order][t]) {
+            continue;
+        }
+        usize s = t * 64 + __builtin_ctzll(avail_top[order][t]);
+        usize i = s * 64 + __builtin_ctzll(avail[order][s]);
+        usize pos = 0;
+        if (order <= 6) {
+            pos = __builtin_ctzll(run_starts(free_bits[i], order));
+            free_bits[i] &= ~run_mask(order, pos);
+            update_summary(i);
+        } else {
+            // The block spans 2^(order - 6) whole words
+            for (usize j = i; j < i + (1ull << (order - 6)); j++) {
+                free_bits[j] = 0;
+                update_summary(j);
+            }
+        }
+        nr_free_frames -= 1ull << order;
+        return pfn_to_page(bitmap_pfn + i * 64 + pos);
+    }
+    return NULL;
+}
+
+static void frames_free(struct page *page, int order)
+{
+    usize index = page_to_pfn(page) - bitmap_pfn;
+    usize i = index / 64;
+    if (order <= 6) {
+        free_bits[i] |= run_mask(order, index & 63);
+        update_summary(i);
+    } else {
+        for (usize j = i; j < i + (1ull << (order - 6)); j++) {
+            free_bits[j] = ~0ull;
+            update_summary(j);
+        }
+    }
+    nr_free_frames += 1ull << order;
+}
+
+static void frames_init(usize pfn, usize stop_pfn)
+{
+    usize first = (pfn - bitmap_pfn) / 64;
+    nr_free_frames += stop_pfn - pfn;
+    while (pfn < stop_pfn) {
+        usize index = pfn - bitmap_pfn;
+        if (!(index & 63) && pfn + 64 <= stop_pfn) {
+            free_bits[index / 64] = ~0ull;
+            pfn += 64;
+        } else {
+            free_bits[index / 64] |= 1ull << (index & 63);
+            pfn++;
+        }
+    }
+    for (usize i = first; i <= (stop_pfn - 1 - bitmap_pfn) / 64; i++) {
+        update_summary(i);
+    }
+}
+#endif
+
+// The pool is set up lazily in max-order chunks (4 MiB), starting with a
+// small seed so that boot does not have to touch all of memory
+#define POOL_CHUNK (1ull << (MAX_ORDER - 1))
+#define POOL_SEED_CHUNKS 4
+
+static bool grow_pool();
+
+// Find the end of RAM in the device tree, or fall back to the size given
+// at build time
+static u64 probe_phys_top()
+{
+    u64 base, size;
+    if (boot_dtb && fdt_find_memory((void *)P2K(boot_dtb), &base, &size)) {
+        return base + size;
+    }
+    return EXTMEM + ((u64)RAM_SIZE_MB << 20);
+}
+
+// Bump allocator for the kernel page table, which is built before there is
+// a frame allocator. Only pages the boot page table maps can be used.
+static void *early_alloc_page()
+{
+    if (heap_base + PAGE_SIZE > (char *)P2K(EXTMEM + 0x40000000ull)) {
+        return NULL;
+    }
+    void *page = heap_base;
+    heap_base += PAGE_SIZE;
+    return page;
+}
 
 void init_pages()
 {
     heap_base = ALIGN_UP_PTR(end, PAGE_SIZE);
 
+    // The boot page table only covers the first 1GB of RAM
+    phys_top = probe_phys_top();
+    if (!kernel_pt_init(phys_top, early_alloc_page)) {
+        printk("PANIC: cannot build the kernel page table\n");
+        arch_stop_cpu();
+    }
+
     // Stop addr in kernel space
-    int counter = 0;
-    char *kernel_stop = P2K(PHYSTOP);
-    for (char *i = heap_base; i + PAGE_SIZE <= kernel_stop; i += PAGE_SIZE) {
-        page_header *p_header = (page_header *)i;
+    char *kernel_stop = (char *)P2K(phys_top);
+    usize total = (kernel_stop - heap_base) / PAGE_SIZE;
 
-        if (free_list) {
-            free_list->prev = p_header;
-        }
-        // p_header->id = counter;
-        // p_header->allocated = false;
-        p_header->next = free_list;
-        free_list = p_header;
-        counter++;
+    // `mem_map` lives at the start of the heap, the rest is handed to the
+    // page frame allocator
+    mem_map = (struct page *)heap_base;
+    char *meta_end = heap_base + total * sizeof(struct page);
+#ifdef KALLOC_BITMAP_BACKEND
+    // The bitmaps follow `mem_map`. They start at a max-order boundary, so
+    // that every aligned block is aligned within the words too.
+    bitmap_pfn = P2N(K2P(heap_base)) & ~((1ull << (MAX_ORDER - 1)) - 1);
+    nr_words = (P2N(phys_top) - bitmap_pfn + 63) / 64;
+    nr_summary = (nr_words + 63) / 64;
+    nr_top = (nr_summary + 63) / 64;
+    free_bits = ALIGN_UP_PTR(meta_end, sizeof(u64));
+    u64 *next = free_bits + nr_words;
+    for (int order = 0; order < MAX_ORDER; order++) {
+        avail[order] = next;
+        avail_top[order] = next + nr_summary;
+        next += nr_summary + nr_top;
+    }
+    meta_end = (char *)next;
+    for (u64 *w = free_bits; w < next; w++) {
+        *w = 0;
     }
+#endif
+    char *pool = ALIGN_UP_PTR(meta_end, PAGE_SIZE);
+    base_pfn = P2N(K2P(pool));
+    nr_frames = (kernel_stop - pool) / PAGE_SIZE;
 
-    // printk("Page start addr: %llu, registered pages: %d\n", (usize)heap_base,
-    //        counter);
-    // printk("Size of header: %llu\n", sizeof(page_header));
+    // Only the seed is ready at boot, the rest follows on demand
+    init_pfn = base_pfn;
+    for (int i = 0; i < POOL_SEED_CHUNKS; i++) {
+        grow_pool();
+    }
+
+    // printk("Page start addr: %llu, registered pages: %llu\n", (usize)pool,
+    //        nr_frames);
 }
 
+// Set up the next chunk of the pool and hand it to the frame allocator.
+// Chunks end on max-order boundaries, so merging never looks at a frame
+// that is not set up yet. Returns false once the whole pool is set up.
+// Must be called with `page_lock` held, except during boot.
+static bool grow_pool()
+{
+    usize stop_pfn = base_pfn + nr_frames;
+    if (init_pfn >= stop_pfn) {
+        return false;
+    }
+
+    usize end_pfn = (init_pfn | (POOL_CHUNK - 1)) + 1;
+    if (end_pfn > stop_pfn) {
+        end_pfn = stop_pfn;
+    }
+    for (usize pfn = init_pfn; pfn < end_pfn; pfn++) {
+        *pfn_to_page(pfn) = (struct page){ 0 };
+    }
+    frames_init(init_pfn, end_pfn);
+    init_pfn = end_pfn;
+    return true;
+}
+
+// Take a block from the frame allocator, growing the pool if needed.
+// Must be called with `page_lock` held.
+static struct page *take_frames(int order)
+{
+    struct page *page = frames_alloc(order);
+    while (!page && grow_pool()) {
+        page = frames_alloc(order);
+    }
+    return page;
+}
+
+// Per-CPU page cache (magazine) sitting in front of the frame allocator.
+// The owner CPU is the only regular user of its cache, so its lock stays
+// uncontended and local; other CPUs only take it when stealing pages under
+// pressure.
+#define PCP_LOW 32   // Refill up to this many pages when the cache runs dry
+#define PCP_HIGH 128 // Drain back down to PCP_LOW once it grows past this
+
+typedef struct {
+    SpinLock lock;
+    struct page *pages; // Singly linked through `next`
+    int count;
+} page_cache;
+
+static DEFINE_PER_CPU(page_cache, pcp);
+
+static void init_size_classes()
+{
+    int tier = 0;
+    for (int i = 0; i <= MAX_BLOCK_SIZE / MIN_SIZE; i++) {
+        while (block_sizes[tier] < i * MIN_SIZE) {
+            tier++;
+        }
+        size_to_tier[i] = tier;
+    }
+}
+
+static bool init_kmem_cache(struct kmem_cache *cache, const char *name,
+                            usize size, usize align, void (*ctor)(void *));
+
 void kinit()
 {
-    init_rc(&kalloc_page_cnt);
+    init_size_classes();
+    init_list_node(&cache_list);
+    init_spinlock(&cache_list_lock);
+    for (int i = 0; i < NR_TIERS; i++) {
+        init_kmem_cache(&kalloc_caches[i], "kalloc", block_sizes[i], MIN_SIZE,
+                        NULL);
+    }
+    init_kmem_cache(&cache_cache, "kmem_cache", sizeof(struct kmem_cache),
+                    CACHE_LINE_SIZE, NULL);
     init_spinlock(&page_lock);
-    init_spinlock(&block_lock);
+    for (int i = 0; i < NCPU; i++) {
+        page_cache *pc = per_cpu_ptr(pcp, i);
+        init_spinlock(&pc->lock);
+        pc->pages = NULL;
+        pc->count = 0;
+    }
 
     init_pages();
 }
 
+// Move up to `n` pages from the frame allocator into `pc`.
+// Must be called with `pc->lock` held.
+static void refill_page_cache(page_cache *pc, int n)
+{
+    this_cpu(pstats).pcp_refills++;
+    acquire_lock_stat(&page_lock);
+    while (n-- > 0) {
+        struct page *page = take_frames(0);
+        if (!page) {
+            break;
+        }
+        page->next = pc->pages;
+        pc->pages = page;
+        pc->count++;
+    }
+    release_spinlock(&page_lock);
+}
+
+// Move up to `n` pages from `pc` back to the frame allocator.
+// Must be called with `pc->lock` held.
+static void drain_page_cache(page_cache *pc, int n)
+{
+    this_cpu(pstats).pcp_drains++;
+    acquire_lock_stat(&page_lock);
+    while (n-- > 0 && pc->pages) {
+        struct page *page = pc->pages;
+        pc->pages = page->next;
+        pc->count--;
+        frames_free(page, 0);
+    }
+    release_spinlock(&page_lock);
+}
+
+// Return every page cached by any CPU to the frame allocator, so that a CPU
+// running out of pages can steal what the others are holding on to.
+void drain_page_caches()
+{
+    for (int i = 0; i < NCPU; i++) {
+        page_cache *pc = per_cpu_ptr(pcp, i);
+        acquire_lock_stat(&pc->lock);
+        drain_page_cache(pc, pc->count);
+        release_spinlock(&pc->lock);
+    }
+}
+
+static void reclaim_slab_pages();
+
+static struct page *alloc_page_frame_local()
+{
+    page_cache *pc = this_cpu_ptr(pcp);
+    acquire_lock_stat(&pc->lock);
+    if (!pc->pages) {
+        refill_page_cache(pc, PCP_LOW);
+    }
+    struct page *page = pc->pages;
+    if (page) {
+        pc->pages = page->next;
+        pc->count--;
+    }
+    release_spinlock(&pc->lock);
+
+    if (!page) {
+        // Frame allocator is empty too, give back empty slab pages and steal
+        // from the other CPUs' caches
+        this_cpu(pstats).steals++;
+        reclaim_slab_pages();
+        drain_page_caches();
+
+        acquire_lock_stat(&page_lock);
+        page = take_frames(0);
+        release_spinlock(&page_lock);
+
+        if (!page) {
+            return NULL;
+        }
+    }
+
+    page->next = page->prev = NULL;
+    this_cpu(pstats).page_allocs++;
+    this_cpu(pstats).pages_in_use++;
+    return page;
+}
+
+// The per-CPU parts of the allocator have no lock of their own: interrupts
+// stay off so that the caller is neither preempted nor moved to another CPU
+// halfway through.
+static struct page *alloc_page_frame()
+{
+    push_off();
+    struct page *page = alloc_page_frame_local();
+    pop_off();
+    return page;
+}
+
+static void free_page_frame(struct page *page)
+{
+    push_off();
+    page_cache *pc = this_cpu_ptr(pcp);
+
+    acquire_lock_stat(&pc->lock);
+    page->flags = 0;
+    page->prev = NULL;
+    page->next = pc->pages;
+    pc->pages = page;
+    pc->count++;
+
+    if (pc->count > PCP_HIGH) {
+        drain_page_cache(pc, pc->count - PCP_LOW);
+    }
+    release_spinlock(&pc->lock);
+
+    this_cpu(pstats).page_frees++;
+    this_cpu(pstats).pages_in_use--;
+    pop_off();
+}
+
 void *kalloc_page()
 {
-    acquire_spinlock(&page_lock);
-    page_header *p_page = free_list;
-    if (!p_page) {
+    struct page *page = alloc_page_frame();
+    if (!page) {
         return NULL;
     }
+    page->refcnt = 1;
+    return page_address(page);
+}
+
+void kfree_page(void *p)
+{
+    struct page *page = virt_to_page(p);
+    if (__atomic_sub_fetch(&page->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_page_frame(page);
+    }
+}
+
+void get_page(void *p)
+{
+    __atomic_fetch_add(&virt_to_page(p)->refcnt, 1, __ATOMIC_RELAXED);
+}
 
-    free_list = p_page->next;
-    if (free_list) {
-        free_list->prev = NULL;
+u32 page_refcount(void *p)
+{
+    return __atomic_load_n(&virt_to_page(p)->refcnt, __ATOMIC_ACQUIRE);
+}
+
+static struct page *alloc_page_block_local(int order)
+{
+    if (order == 0) {
+        return alloc_page_frame_local();
+    }
+    if (order < 0 || order >= MAX_ORDER) {
+        return NULL;
     }
-    p_page->next = p_page->prev = NULL;
 
-    increment_rc(&kalloc_page_cnt);
+    acquire_lock_stat(&page_lock);
+    struct page *page = take_frames(order);
     release_spinlock(&page_lock);
 
-    return p_page;
+    if (!page) {
+        // Cached single pages may be keeping buddies from merging
+        reclaim_slab_pages();
+        drain_page_caches();
+
+        acquire_lock_stat(&page_lock);
+        page = take_frames(order);
+        release_spinlock(&page_lock);
+
+        if (!page) {
+            return NULL;
+        }
+    }
+
+    page->next = page->prev = NULL;
+    this_cpu(pstats).block_allocs++;
+    this_cpu(pstats).pages_in_use += 1ll << order;
+    return page;
 }
 
-void kfree_page(void *p)
+// Interrupts off for the same reason as alloc_page_frame(): the per-CPU
+// counters, and the slab lists reclaim_slab_pages() shrinks, belong to the
+// CPU we started on.
+static struct page *alloc_page_block(int order)
 {
-    // Insert into free list
-    acquire_spinlock(&page_lock);
-    page_header *p_page = p;
-    if (free_list) {
-        free_list->prev = p_page;
-    }
+    push_off();
+    struct page *page = alloc_page_block_local(order);
+    pop_off();
+    return page;
+}
 
-    // p_page->allocated = false;
-    p_page->filled_blocks = 0;
-    p_page->free_block = NULL;
-    p_page->prev = NULL;
-    p_page->next = free_list;
-    free_list = p_page;
+static void free_page_block(struct page *page, int order)
+{
+    if (order == 0) {
+        free_page_frame(page);
+        return;
+    }
 
-    decrement_rc(&kalloc_page_cnt);
+    acquire_lock_stat(&page_lock);
+    frames_free(page, order);
     release_spinlock(&page_lock);
 
-    return;
+    push_off();
+    this_cpu(pstats).block_frees++;
+    this_cpu(pstats).pages_in_use -= 1ll << order;
+    pop_off();
+}
+
+void *kalloc_pages(int order)
+{
+    struct page *page = alloc_page_block(order);
+    return page ? page_address(page) : NULL;
+}
+
+void kfree_pages(void *p, int order)
+{
+    free_page_block(virt_to_page(p), order);
 }
 
 #define DEBUG_LINE printk("Line %d run\n", __LINE__)
 
+static INLINE char **freeptr_of(struct kmem_cache *cache, void *obj)
+{
+    return (char **)((char *)obj + cache->freeptr);
+}
+
 // Get full pages out of partial_list
-void remove_from_list(page_header *p_page)
+void remove_from_list(struct page *page)
 {
-    if (p_page->prev) {
-        p_page->prev->next = p_page->next;
+    if (page->prev) {
+        page->prev->next = page->next;
     } else {
-        partial_list[p_page->tier] = p_page->next;
+        page->cache->cpu[page->owner].partial_list = page->next;
     }
 
-    if (p_page->next) {
-        p_page->next->prev = p_page->prev;
+    if (page->next) {
+        page->next->prev = page->prev;
     }
 
-    p_page->prev = p_page->next = NULL;
+    page->prev = page->next = NULL;
 }
 
 // Add page to list if they get partially-full
-void add_to_list(page_header *p_page)
+void add_to_list(struct page *page)
 {
-    int tier = p_page->tier;
-    if (partial_list[tier]) {
-        partial_list[tier]->prev = p_page;
+    struct page **list = &page->cache->cpu[page->owner].partial_list;
+    if (*list) {
+        (*list)->prev = page;
     }
 
-    p_page->next = partial_list[tier];
-    p_page->prev = NULL;
-    partial_list[tier] = p_page;
+    page->next = *list;
+    page->prev = NULL;
+    *list = page;
 }
 
-// Debug code, to check if the linked list works properly
-void __walk_list(page_header *lk)
+// Initialize a page to become a container of blocks of a certain cache
+void setup_page(struct page *page, struct kmem_cache *cache)
 {
-    page_header *pg = lk, *prev_pg;
-    int cnt = 0;
-    while (pg != NULL) {
-        prev_pg = pg;
-        pg = pg->next;
-        cnt++;
-    }
-
-    printk("Forward walk, found %d pages!\n", cnt);
-    cnt = 1;
+    int cpu = cpuid();
+    page->flags = PG_SLAB;
+    page->cache = cache;
+    page->owner = cpu;
+    page->free_block = NULL;
+    page->filled_blocks = 0;
+    page->unused = 0;
+    page->next = page->prev = NULL;
 
-    pg = prev_pg;
-    while (pg != lk) {
-        pg = pg->prev;
-        cnt++;
+    cache->cpu[cpu].stats.pages++;
+    page->colour = cache->cpu[cpu].colour_next;
+    if (++cache->cpu[cpu].colour_next >= cache->nr_colours) {
+        cache->cpu[cpu].colour_next = 0;
     }
 
-    printk("Backward walk, found %d pages!\n", cnt);
+    // Insert page into the partial list of the cache. Blocks are carved
+    // from the untouched part of the page on demand, see take_block().
+    add_to_list(page);
 }
 
-int __count_free_blocks(char *free_blk_ptr)
+static INLINE bool page_full(struct page *page)
 {
-    int counter = 0;
-    while (free_blk_ptr) {
-        free_blk_ptr = *((char **)free_blk_ptr);
-        counter++;
-    }
+    return !page->free_block && page->unused == page->cache->nr_objects;
+}
 
-    return counter;
+// Take a free block from a page that is not full. Recycled blocks are
+// preferred, so that the untouched part of the page stays untouched.
+static void *take_block(struct page *page)
+{
+    struct kmem_cache *cache = page->cache;
+    char *obj = page->free_block;
+    if (obj) {
+        page->free_block = *freeptr_of(cache, obj);
+    } else {
+        // The whole frame is payload, as the header lives in `mem_map`
+        obj = (char *)page_address(page) + page->colour * cache->colour_unit +
+              page->unused * cache->stride;
+        page->unused++;
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+    }
+    page->filled_blocks++;
+    return obj;
 }
 
-// Initialize a page to become a container of blocks of a certain size
-void setup_page(page_header *p_page, int tier)
+static bool init_kmem_cache(struct kmem_cache *cache, const char *name,
+                            usize size, usize align, void (*ctor)(void *))
 {
-    /*
-    if (p_page->allocated) {
-        printk("PANIC: page %d re-allcated!\n", p_page->id);
+    // The free-list link needs a pointer-aligned slot
+    align = MAX(align, (usize)MIN_SIZE);
+    if (size == 0 || (align & (align - 1))) {
+        return false;
+    }
+
+    cache->name = name;
+    cache->size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+    if (ctor) {
+        cache->freeptr = round_up(size, sizeof(char *));
+        cache->stride = round_up(cache->freeptr + sizeof(char *), align);
+    } else {
+        cache->freeptr = 0;
+        cache->stride = round_up(MAX(size, (usize)MIN_SIZE), align);
+    }
+    if (cache->stride > PAGE_SIZE) {
+        return false;
     }
-    */
+    cache->nr_objects = PAGE_SIZE / cache->stride;
 
-    p_page->tier = tier;
-    p_page->free_block = NULL;
-    p_page->filled_blocks = 0;
-    // p_page->allocated = true;
-    p_page->next = p_page->prev = NULL;
+    // Colour offsets must keep every object aligned
+    cache->colour_unit = MAX(align, (usize)CACHE_LINE_SIZE);
+    cache->nr_colours =
+            (PAGE_SIZE - cache->nr_objects * cache->stride) / cache->colour_unit +
+            1;
 
-    // Insert page into the partial list of the block size
-    add_to_list(p_page);
+    for (int i = 0; i < NCPU; i++) {
+        cache->cpu[i].partial_list = NULL;
+        cache->cpu[i].empty_list = NULL;
+        cache->cpu[i].nr_empty = 0;
+        cache->cpu[i].colour_next = 0;
+        cache->cpu[i].stats = (slab_stats){ 0 };
+    }
 
-    const u64 block_size = block_sizes[tier];
-    char *payload_start = ((char *)p_page) + sizeof(page_header);
-    // Align to 8
-    payload_start = ALIGN_UP_PTR(payload_start, 8);
+    insert_into_list(&cache_list_lock, &cache_list, &cache->node);
+    return true;
+}
 
-    const char *upper_bound = (char *)p_page + PAGE_SIZE;
-    for (char *i = payload_start; i + block_size < upper_bound;
-         i += block_size) {
-        *((char **)i) = p_page->free_block;
-        p_page->free_block = i;
+struct kmem_cache *kmem_cache_create(const char *name, usize size, usize align,
+                                     void (*ctor)(void *))
+{
+    struct kmem_cache *cache = kmem_cache_alloc(&cache_cache);
+    if (!cache) {
+        return NULL;
+    }
+    if (!init_kmem_cache(cache, name, size, align, ctor)) {
+        printk("PANIC: cannot create cache %s of size %llu\n", name, size);
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
     }
+    return cache;
 }
 
-// Get the block size tier of the given size
+// Get the block size tier of the given size, which must not exceed
+// MAX_BLOCK_SIZE
 int get_tier(unsigned long long size)
 {
-    // Ceil size to power of 2
-    int leading_zeros = __builtin_clzll(size - 1);
-    size = 0x8000000000000000 >> (leading_zeros - 1);
+    return size_to_tier[(size + MIN_SIZE - 1) / MIN_SIZE];
+}
 
-    // Map size to tier by `tier = log2(size) - 3` (ctz is a fast equivalent to log2)
-    int trailing_zeros = __builtin_ctzll(size);
-    return MAX(0, trailing_zeros - 3);
+// Free the pages [from, to) of a block starting at `page` that is aligned
+// to at least the run's length, as aligned buddy blocks.
+static void free_page_run(struct page *page, usize from, usize to)
+{
+    while (from < to) {
+        int order = from ? __builtin_ctzll(from) : MAX_ORDER - 1;
+        while (from + (1ull << order) > to) {
+            order--;
+        }
+        free_page_block(page + from, order);
+        from += 1ull << order;
+    }
 }
 
-void *kalloc(unsigned long long size)
+// Objects above the largest tier get whole pages. The run is cut from the
+// smallest buddy block that fits, and the unused tail goes straight back.
+static void *kalloc_large(unsigned long long size)
 {
-    if (size == 0) {
-        // Cannot allocate zero size
+    usize npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    int order = 0;
+    while ((1ull << order) < npages) {
+        order++;
+    }
+    if (order >= MAX_ORDER) {
+        printk("PANIC: %llu is larger than the largest page block. \n", size);
         return NULL;
     }
 
-    if (size > 2048) {
-        printk("PANIC: %llu is larger than 2048. \n", size);
+    struct page *page = alloc_page_block(order);
+    if (!page) {
         return NULL;
     }
 
-    int tier = get_tier(size);
-    acquire_spinlock(&block_lock);
+    free_page_run(page, npages, 1ull << order);
 
-    page_header *p_page = partial_list[tier];
-    // No empty list
-    if (!p_page) {
-        p_page = kalloc_page();
-        if (!p_page) {
-            printk("PANIC: cannot alloc page for tier %d, used pages: %d, returning NULL\n",
-                   tier, kalloc_page_cnt.count);
-            return NULL;
+    page->flags = PG_LARGE;
+    page->npages = npages;
+    return page_address(page);
+}
+
+// Put a block back into its page. Must be called on the page's owner CPU.
+static void free_block(struct page *page, void *ptr)
+{
+    // The page has empty space again after free, add back to partial list
+    if (page_full(page)) {
+        add_to_list(page);
+        page->cache->cpu[page->owner].stats.full_pages--;
+    }
+
+    *freeptr_of(page->cache, ptr) = page->free_block;
+    page->free_block = ptr;
+
+    page->filled_blocks--;
+    if (page->filled_blocks == 0) {
+        // Remove from partial list, and then either keep the page around
+        // for the next allocation or free it
+        remove_from_list(page);
+        struct kmem_cache *cache = page->cache;
+        int cpu = page->owner;
+        if (cache->cpu[cpu].nr_empty < SLAB_EMPTY_MAX) {
+            page->next = cache->cpu[cpu].empty_list;
+            cache->cpu[cpu].empty_list = page;
+            cache->cpu[cpu].nr_empty++;
+            cache->cpu[cpu].stats.empty_pages++;
+        } else {
+            cache->cpu[cpu].stats.pages--;
+            free_page_frame(page);
         }
+    }
+}
 
-        setup_page(p_page, tier);
+// Free the empty pages `cpu` keeps for `cache`. Must be called on `cpu`.
+static void shrink_cache(struct kmem_cache *cache, int cpu)
+{
+    while (cache->cpu[cpu].empty_list) {
+        struct page *page = cache->cpu[cpu].empty_list;
+        cache->cpu[cpu].empty_list = page->next;
+        cache->cpu[cpu].nr_empty--;
+        cache->cpu[cpu].stats.empty_pages--;
+        cache->cpu[cpu].stats.pages--;
+        free_page_frame(page);
     }
+}
 
-    if (p_page->tier != tier) {
-        printk("PANIC: tier mismatch, wanted %d, given %d\n",
-            tier, p_page->tier);
+// Free the empty pages of every cache kept by this CPU
+static void shrink_caches(int cpu)
+{
+    per_cpu(reclaim_seen, cpu) = reclaim_gen;
+
+    acquire_spinlock(&cache_list_lock);
+    _for_in_list(node, &cache_list)
+    {
+        if (node != &cache_list) {
+            shrink_cache(container_of(node, struct kmem_cache, node), cpu);
+        }
     }
+    release_spinlock(&cache_list_lock);
+}
 
-    void *addr = p_page->free_block;
-    if (!addr) {
-        printk("PANIC: full page in partial list\n");
+// Called under memory pressure. Other CPUs only see the request the next
+// time they allocate or free, so this CPU gives back its own pages now.
+static void reclaim_slab_pages()
+{
+    __atomic_fetch_add(&reclaim_gen, 1, __ATOMIC_RELAXED);
+    shrink_caches(cpuid());
+}
+
+void kmem_cache_reclaim()
+{
+    push_off();
+    reclaim_slab_pages();
+    pop_off();
+}
+
+// Take back the blocks other CPUs have freed into this CPU's pages. The
+// link sits inside the object's slot, so it shares the object's page.
+static void reclaim_remote_frees(int cpu)
+{
+    QueueNode *node = fetch_all_from_queue(per_cpu_ptr(remote_free, cpu));
+    while (node) {
+        QueueNode *next = node->next;
+        struct page *page = virt_to_page(node);
+        free_block(page, (char *)node - page->cache->freeptr);
+        node = next;
+    }
+}
+
+static void *cache_alloc_local(struct kmem_cache *cache, usize requested)
+{
+    int cpu = cpuid();
+    if (per_cpu(remote_free, cpu)) {
+        reclaim_remote_frees(cpu);
+    }
+    if (per_cpu(reclaim_seen, cpu) != reclaim_gen) {
+        shrink_caches(cpu);
     }
-    p_page->free_block = *((char **)addr);
 
-    p_page->filled_blocks++;
-    if (!p_page->free_block) {
-        remove_from_list(p_page);
+    struct page *page = cache->cpu[cpu].partial_list;
+    if (!page && cache->cpu[cpu].empty_list) {
+        // Reuse a cached empty page, its free chain is still intact
+        page = cache->cpu[cpu].empty_list;
+        cache->cpu[cpu].empty_list = page->next;
+        cache->cpu[cpu].nr_empty--;
+        cache->cpu[cpu].stats.empty_pages--;
+        add_to_list(page);
     }
+    // No partial or empty page
+    if (!page) {
+        page = alloc_page_frame();
+        if (!page) {
+            printk("PANIC: cannot alloc page for cache %s, used pages: %lld, returning NULL\n",
+                   cache->name, kalloc_page_count());
+            return NULL;
+        }
 
-    release_spinlock(&block_lock);
+        setup_page(page, cache);
+    }
+
+    if (page_full(page)) {
+        printk("PANIC: full page in partial list\n");
+        return NULL;
+    }
+    void *addr = take_block(page);
+    if (page_full(page)) {
+        remove_from_list(page);
+        cache->cpu[cpu].stats.full_pages++;
+    }
+
+    slab_stats *st = &cache->cpu[cpu].stats;
+    st->allocs++;
+    st->bytes_requested += requested;
+    st->bytes_allocated += cache->stride;
+    return addr;
+}
+
+static void *cache_alloc(struct kmem_cache *cache, usize requested)
+{
+    push_off();
+    void *addr = cache_alloc_local(cache, requested);
+    pop_off();
     return addr;
 }
 
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    return cache_alloc(cache, cache->size);
+}
+
+static void cache_free_local(struct kmem_cache *cache, void *ptr)
+{
+    struct page *page = virt_to_page(ptr);
+    int cpu = cpuid();
+    cache->cpu[cpu].stats.frees++;
+    if (page->owner != cpu) {
+        cache->cpu[cpu].stats.remote_frees++;
+        // Hand the block over to its owner without touching the page
+        add_to_queue(per_cpu_ptr(remote_free, page->owner),
+                     (QueueNode *)freeptr_of(cache, ptr));
+        return;
+    }
+
+    free_block(page, ptr);
+    if (per_cpu(remote_free, cpu)) {
+        reclaim_remote_frees(cpu);
+    }
+    if (per_cpu(reclaim_seen, cpu) != reclaim_gen) {
+        shrink_caches(cpu);
+    }
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *ptr)
+{
+    push_off();
+    cache_free_local(cache, ptr);
+    pop_off();
+}
+
+void *kalloc(unsigned long long size)
+{
+    if (size == 0) {
+        // Cannot allocate zero size
+        return NULL;
+    }
+
+    if (size > MAX_BLOCK_SIZE) {
+        return kalloc_large(size);
+    }
+
+    return cache_alloc(&kalloc_caches[get_tier(size)], size);
+}
+
 void kfree(void *ptr)
 {
     if (!ptr) {
@@ -273,25 +1197,100 @@ void kfree(void *ptr)
         return;
     }
 
-    acquire_spinlock(&block_lock);
-    page_header *p_page = ALIGN_DOWN_PTR(ptr, PAGE_SIZE);
+    struct page *page = virt_to_page(ptr);
+    if (page->flags & PG_LARGE) {
+        page->flags &= ~PG_LARGE;
+        free_page_run(page, 0, page->npages);
+        return;
+    }
 
-    // The page has empty space again after free, add back to partial list
-    if (!p_page->free_block) {
-        add_to_list(p_page);
+    kmem_cache_free(page->cache, ptr);
+}
+
+isize kalloc_page_count()
+{
+    isize n = 0;
+    for (int i = 0; i < NCPU; i++) {
+        n += per_cpu(pstats, i).pages_in_use;
+    }
+    return n;
+}
+
+void kalloc_stats()
+{
+    page_stats pages = { 0 };
+    for (int i = 0; i < NCPU; i++) {
+        page_stats *ps = per_cpu_ptr(pstats, i);
+        pages.page_allocs += ps->page_allocs;
+        pages.page_frees += ps->page_frees;
+        pages.block_allocs += ps->block_allocs;
+        pages.block_frees += ps->block_frees;
+        pages.pcp_refills += ps->pcp_refills;
+        pages.pcp_drains += ps->pcp_drains;
+        pages.steals += ps->steals;
+        pages.lock_contended += ps->lock_contended;
+        pages.lock_wait_ticks += ps->lock_wait_ticks;
+        pages.pages_in_use += ps->pages_in_use;
     }
 
-    *((char **)ptr) = p_page->free_block;
-    p_page->free_block = ptr;
+    printk("pages: %lld in use, %llu/%llu allocs/frees, %llu/%llu block allocs/frees\n",
+           pages.pages_in_use, pages.page_allocs, pages.page_frees,
+           pages.block_allocs, pages.block_frees);
+    printk("page caches: %llu refills, %llu drains, %llu steals\n",
+           pages.pcp_refills, pages.pcp_drains, pages.steals);
+    printk("lock contention: %llu waits, %llu ticks\n", pages.lock_contended,
+           pages.lock_wait_ticks);
 
-    p_page->filled_blocks--;
-    if (p_page->filled_blocks <= 0) {
-        // Remove from partial list, and then free page
-        remove_from_list(p_page);
-        // p_page->allocated = false;
-        kfree_page(p_page);
+    acquire_spinlock(&page_lock);
+    printk("pool: %llu of %llu frames set up\n", init_pfn - base_pfn, nr_frames);
+#ifndef KALLOC_BITMAP_BACKEND
+    printk("free blocks by order:");
+    for (int i = 0; i < MAX_ORDER; i++) {
+        printk(" %llu", nr_free[i]);
+    }
+    printk("\n");
+#else
+    printk("free frames: %llu\n", nr_free_frames);
+#endif
+    release_spinlock(&page_lock);
+
+    u64 requested = 0, allocated = 0;
+    acquire_spinlock(&cache_list_lock);
+    _for_in_list(node, &cache_list)
+    {
+        if (node == &cache_list) {
+            continue;
+        }
+
+        struct kmem_cache *cache = container_of(node, struct kmem_cache, node);
+        slab_stats st = { 0 };
+        for (int i = 0; i < NCPU; i++) {
+            slab_stats *s = &cache->cpu[i].stats;
+            st.allocs += s->allocs;
+            st.frees += s->frees;
+            st.remote_frees += s->remote_frees;
+            st.bytes_requested += s->bytes_requested;
+            st.bytes_allocated += s->bytes_allocated;
+            st.pages += s->pages;
+            st.full_pages += s->full_pages;
+            st.empty_pages += s->empty_pages;
+        }
+        if (!st.allocs && !st.pages) {
+            continue;
+        }
+
+        printk("%s-%u: %llu/%llu allocs/frees (%llu remote), %llu pages (%llu full, %llu partial, %llu empty), %llu/%llu bytes requested/handed out\n",
+               cache->name, cache->size, st.allocs, st.frees, st.remote_frees,
+               st.pages, st.full_pages,
+               st.pages - st.full_pages - st.empty_pages, st.empty_pages,
+               st.bytes_requested, st.bytes_allocated);
+        requested += st.bytes_requested;
+        allocated += st.bytes_allocated;
     }
+    release_spinlock(&cache_list_lock);
 
-    release_spinlock(&block_lock);
-    return;
+    if (allocated) {
+        printk("slab internal fragmentation: %llu%%\n",
+               (allocated - requested) * 100 / allocated);
+    }
 }
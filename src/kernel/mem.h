@@ -1,9 +1,38 @@
 #pragma once
 
+#include <common/defines.h>
+
 void kinit();
 
 void* kalloc_page();
+// Drop a reference to a page from kalloc_page(), freeing it with the last
 void kfree_page(void*);
+// Take another reference, e.g. when a page is shared copy-on-write
+void get_page(void*);
+u32 page_refcount(void*);
+void drain_page_caches();
+
+// Allocate/free 2^order physically contiguous pages, aligned to their size.
+void* kalloc_pages(int order);
+void kfree_pages(void*, int order);
 
 void* kalloc(unsigned long long);
 void kfree(void*);
+
+// Caches of fixed-size objects. `align` must be a power of two, and `ctor`
+// (if any) runs once per object when it is first carved from its slab page;
+// objects are expected to be returned to the cache in their constructed
+// state.
+struct kmem_cache;
+struct kmem_cache* kmem_cache_create(const char* name, usize size, usize align,
+                                     void (*ctor)(void*));
+void* kmem_cache_alloc(struct kmem_cache*);
+void kmem_cache_free(struct kmem_cache*, void*);
+// Give back the empty slab pages kept by the caches. The calling CPU frees
+// its pages at once, the others on their next allocation or free.
+void kmem_cache_reclaim();
+
+// Pages handed out and not freed yet, summed over all CPUs
+isize kalloc_page_count();
+// Dump allocator counters summed over all CPUs
+void kalloc_stats();
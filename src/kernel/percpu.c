@@ -0,0 +1,23 @@
+#include <common/string.h>
+#include <kernel/percpu.h>
+
+// From linker.ld: the template, and room for NCPU copies of it
+extern char percpu_start[], percpu_end[], percpu_copies[];
+
+u64 percpu_offset[NCPU];
+
+void init_percpu()
+{
+    usize size = (usize)(percpu_end - percpu_start);
+    for (int i = 0; i < NCPU; i++) {
+        char *copy = percpu_copies + i * size;
+        memcpy(copy, percpu_start, size);
+        percpu_offset[i] = (u64)(copy - percpu_start);
+    }
+    percpu_install();
+}
+
+void percpu_install()
+{
+    arch_set_tid(percpu_offset[cpuid()]);
+}
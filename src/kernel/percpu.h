@@ -0,0 +1,29 @@
+#pragma once
+
+#include <aarch64/intrinsic.h>
+#include <common/defines.h>
+
+// Per-CPU variables live in the .percpu section. The section is only a
+// template: init_percpu() gives every CPU its own copy, cache-line aligned
+// so that no two CPUs share a line, and tpidr_el1 holds the distance from
+// the template to the copy of the running CPU.
+//
+// Variables must be reached through the accessors below, never directly.
+#define DEFINE_PER_CPU(type, name) __attribute__((section(".percpu"))) type name
+#define DECLARE_PER_CPU(type, name) extern DEFINE_PER_CPU(type, name)
+
+// Distance from the template to the copy of each CPU
+extern u64 percpu_offset[NCPU];
+
+#define per_cpu_ptr(var, cpu) \
+    ((typeof(&(var)))((u64)&(var) + percpu_offset[cpu]))
+#define this_cpu_ptr(var) ((typeof(&(var)))((u64)&(var) + arch_get_tid()))
+// The copy of `var` of CPU `cpu`, or of the calling CPU. The caller must
+// not move to another CPU while using it.
+#define per_cpu(var, cpu) (*per_cpu_ptr(var, cpu))
+#define this_cpu(var) (*this_cpu_ptr(var))
+
+// Set up the copies of all CPUs, on CPU 0 before anything else uses them
+void init_percpu();
+// Point tpidr_el1 of the calling CPU at its copy
+void percpu_install();
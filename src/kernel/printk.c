@@ -2,7 +2,7 @@
 #include <common/spinlock.h>
 #include <kernel/printk.h>
 
-static SpinLock printk_lock;
+static SpinLock printk_lock CACHELINE_ALIGNED;
 
 void printk_init()
 {
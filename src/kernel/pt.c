@@ -0,0 +1,543 @@
+#include <aarch64/intrinsic.h>
+#include <common/spinlock.h>
+#include <common/string.h>
+#include <kernel/mem.h>
+#include <kernel/percpu.h>
+#include <kernel/printk.h>
+#include <kernel/pt.h>
+
+// ASIDs tag TLB entries of non-global (user) pages, so switching address
+// spaces needs no TLB flush. They are handed out in generations: when the
+// 16-bit space runs out, a new generation starts with a single full flush,
+// and address spaces from older generations get a fresh ASID when they are
+// attached next.
+#define ASID_BITS 16
+#define ASID_MASK ((1ull << ASID_BITS) - 1)
+
+static SpinLock asid_lock CACHELINE_ALIGNED;
+static u64 asid_generation = 1ull << ASID_BITS;
+// ASID 0 is used by the kernel while no address space is attached
+static u64 next_asid = 1;
+// Address space each CPU is running on
+static DEFINE_PER_CPU(struct pgdir *, active_pgdir);
+// Backs every anonymous page that was read but not written yet. It holds a
+// reference of its own, so copy-on-write never hands it out.
+static void *zero_page;
+
+void init_pt()
+{
+    init_spinlock(&asid_lock);
+    zero_page = kalloc_page();
+    if (!zero_page) {
+        printk("PANIC: cannot alloc zero page\n");
+        return;
+    }
+    memset(zero_page, 0, PAGE_SIZE);
+}
+
+static bool asid_in_use(u64 asid)
+{
+    for (int i = 0; i < NCPU; i++) {
+        struct pgdir *active = per_cpu(active_pgdir, i);
+        if (active && (active->asid & ASID_MASK) == asid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Must be called with `asid_lock` held
+static void new_asid(struct pgdir *pgdir)
+{
+    while (next_asid <= ASID_MASK && asid_in_use(next_asid)) {
+        next_asid++;
+    }
+
+    if (next_asid > ASID_MASK) {
+        // Roll over. Address spaces that are running keep their ASID in the
+        // new generation, all others start over.
+        asid_generation += 1ull << ASID_BITS;
+        for (int i = 0; i < NCPU; i++) {
+            struct pgdir *active = per_cpu(active_pgdir, i);
+            if (active) {
+                active->asid = asid_generation | (active->asid & ASID_MASK);
+            }
+        }
+        arch_tlbi_vmalle1is();
+
+        next_asid = 1;
+        while (asid_in_use(next_asid)) {
+            next_asid++;
+        }
+    }
+
+    pgdir->asid = asid_generation | next_asid++;
+}
+
+void init_pgdir(struct pgdir *pgdir)
+{
+    pgdir->pt = NULL;
+    pgdir->asid = 0;
+    init_spinlock(&pgdir->lock);
+    pgdir->regions = NULL;
+}
+
+// Free a level-`level` table and the tables below it, dropping the
+// references of the pages they map
+static void free_table(PTEntriesPtr pt, int level)
+{
+    for (int i = 0; i < N_PTE_PER_TABLE; i++) {
+        if (!(pt[i] & PTE_VALID)) {
+            continue;
+        }
+        if (level < 3) {
+            free_table((PTEntriesPtr)P2K(PTE_ADDRESS(pt[i])), level + 1);
+        } else {
+            kfree_page((void *)P2K(PTE_ADDRESS(pt[i])));
+        }
+    }
+    kfree_page(pt);
+}
+
+// Current ASID of `pgdir`, or 0 if none of its entries can be in the TLB
+static u64 live_asid(struct pgdir *pgdir)
+{
+    acquire_spinlock(&asid_lock);
+    u64 asid = pgdir->asid;
+    release_spinlock(&asid_lock);
+
+    // Entries of older generations were flushed on rollover. Should one
+    // start right after this check, it flushes everything anyway.
+    if ((asid & ~ASID_MASK) != asid_generation) {
+        return 0;
+    }
+    return asid & ASID_MASK;
+}
+
+void free_pgdir(struct pgdir *pgdir)
+{
+    // Pages faulted in for the regions go with the tables below
+    while (pgdir->regions) {
+        struct anon_region *region = pgdir->regions;
+        pgdir->regions = region->next;
+        kfree(region);
+    }
+
+    if (pgdir->pt) {
+        // Drop cached walks too, before the tables go back to the allocator
+        u64 asid = live_asid(pgdir);
+        if (asid) {
+            arch_tlbi_prepare();
+            arch_tlbi_aside1is(asid);
+            arch_tlbi_sync();
+        }
+
+        free_table(pgdir->pt, 0);
+        pgdir->pt = NULL;
+    }
+}
+
+void attach_pgdir(struct pgdir *pgdir)
+{
+    int cpu = cpuid();
+
+    acquire_spinlock(&asid_lock);
+    if (!pgdir || !pgdir->pt) {
+        per_cpu(active_pgdir, cpu) = NULL;
+        release_spinlock(&asid_lock);
+        arch_set_ttbr0_asid(K2P(kernel_pt_empty), 0);
+        return;
+    }
+
+    if ((pgdir->asid & ~ASID_MASK) != asid_generation) {
+        new_asid(pgdir);
+    }
+    per_cpu(active_pgdir, cpu) = pgdir;
+    u64 asid = pgdir->asid & ASID_MASK;
+    release_spinlock(&asid_lock);
+
+    arch_set_ttbr0_asid(K2P(pgdir->pt), asid);
+}
+
+struct pgdir *current_pgdir()
+{
+    return this_cpu(active_pgdir);
+}
+
+static PTEntriesPtr alloc_table()
+{
+    PTEntriesPtr pt = kalloc_page();
+    if (pt) {
+        memset(pt, 0, PAGE_SIZE);
+    }
+    return pt;
+}
+
+PTEntriesPtr get_pte(struct pgdir *pgdir, u64 va, bool alloc)
+{
+    if (!pgdir->pt) {
+        if (!alloc || !(pgdir->pt = alloc_table())) {
+            return NULL;
+        }
+    }
+
+    PTEntriesPtr pt = pgdir->pt;
+    for (int level = 0; level < 3; level++) {
+        PTEntry *pte = &pt[(va >> (39 - 9 * level)) & (N_PTE_PER_TABLE - 1)];
+        if (!(*pte & PTE_VALID)) {
+            if (!alloc) {
+                return NULL;
+            }
+            PTEntriesPtr table = alloc_table();
+            if (!table) {
+                return NULL;
+            }
+            *pte = K2P(table) | PTE_TABLE;
+        }
+        pt = (PTEntriesPtr)P2K(PTE_ADDRESS(*pte));
+    }
+    return &pt[VA_PART3(va)];
+}
+
+bool pgdir_map(struct pgdir *pgdir, u64 va, u64 pa, u64 size, u64 flags)
+{
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, pgdir);
+    bool ok = true;
+    // Faults walk and fill in the same tables
+    acquire_spinlock(&pgdir->lock);
+    for (u64 off = 0; off < size; off += PAGE_SIZE) {
+        PTEntriesPtr pte = get_pte(pgdir, va + off, true);
+        if (!pte) {
+            printk("PANIC: cannot alloc page table for %llx\n", va + off);
+            ok = false;
+            break;
+        }
+        // Replacing a mapping, the old one may be cached
+        if (*pte & PTE_VALID) {
+            tlb_gather_page(&tlb, va + off);
+            tlb_gather_free(&tlb, (void *)P2K(PTE_ADDRESS(*pte)));
+        }
+        get_page((void *)P2K(pa + off));
+        *pte = (pa + off) | flags;
+    }
+    tlb_flush(&tlb);
+    release_spinlock(&pgdir->lock);
+    return ok;
+}
+
+void pgdir_unmap(struct pgdir *pgdir, u64 va, u64 size)
+{
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, pgdir);
+    acquire_spinlock(&pgdir->lock);
+    for (u64 off = 0; off < size; off += PAGE_SIZE) {
+        PTEntriesPtr pte = get_pte(pgdir, va + off, false);
+        if (pte && (*pte & PTE_VALID)) {
+            void *page = (void *)P2K(PTE_ADDRESS(*pte));
+            *pte = 0;
+            tlb_gather_page(&tlb, va + off);
+            tlb_gather_free(&tlb, page);
+        }
+    }
+    tlb_flush(&tlb);
+    release_spinlock(&pgdir->lock);
+}
+
+// Above this many pages, dropping the whole ASID is cheaper than going
+// page by page
+#define TLB_FLUSH_MAX_PAGES 64
+
+// Whether FEAT_TLBIRANGE is there: -1 until checked
+static int tlbi_range = -1;
+
+void tlb_gather_init(struct tlb_gather *tlb, struct pgdir *pgdir)
+{
+    tlb->pgdir = pgdir;
+    tlb->start = tlb->end = 0;
+    tlb->nr_pages = 0;
+}
+
+void tlb_gather_page(struct tlb_gather *tlb, u64 va)
+{
+    va = PAGE_BASE(va);
+    if (tlb->start == tlb->end) {
+        tlb->start = va;
+        tlb->end = va + PAGE_SIZE;
+    } else {
+        tlb->start = MIN(tlb->start, va);
+        tlb->end = MAX(tlb->end, va + PAGE_SIZE);
+    }
+}
+
+void tlb_gather_free(struct tlb_gather *tlb, void *page)
+{
+    if (tlb->nr_pages == TLB_GATHER_PAGES) {
+        tlb_flush(tlb);
+    }
+    tlb->pages[tlb->nr_pages++] = page;
+}
+
+// Drop the references held back until the flush
+static void free_gathered_pages(struct tlb_gather *tlb)
+{
+    for (int i = 0; i < tlb->nr_pages; i++) {
+        kfree_page(tlb->pages[i]);
+    }
+    tlb->nr_pages = 0;
+}
+
+void tlb_flush(struct tlb_gather *tlb)
+{
+    if (tlb->start == tlb->end) {
+        free_gathered_pages(tlb);
+        return;
+    }
+    u64 asid = live_asid(tlb->pgdir);
+    if (!asid) {
+        tlb->start = tlb->end = 0;
+        free_gathered_pages(tlb);
+        return;
+    }
+    if (tlbi_range < 0) {
+        tlbi_range = arch_has_tlbi_range();
+    }
+
+    u64 pages = (tlb->end - tlb->start) / PAGE_SIZE;
+    arch_tlbi_prepare();
+    if (pages > TLB_FLUSH_MAX_PAGES) {
+        arch_tlbi_aside1is(asid);
+    } else if (tlbi_range) {
+        // Covers an even number of pages, one more than asked is harmless
+        arch_tlbi_rvae1is(tlb->start, asid, (pages + 1) / 2 - 1);
+    } else {
+        for (u64 va = tlb->start; va < tlb->end; va += PAGE_SIZE) {
+            arch_tlbi_vae1is(va, asid);
+        }
+    }
+    arch_tlbi_sync();
+
+    tlb->start = tlb->end = 0;
+    free_gathered_pages(tlb);
+}
+
+// Share the pages under the level-`level` table `pt`, which maps the
+// addresses from `va`
+static bool copy_table(struct pgdir *dst, PTEntriesPtr pt, int level, u64 va,
+                       struct tlb_gather *tlb)
+{
+    for (int i = 0; i < N_PTE_PER_TABLE; i++) {
+        if (!(pt[i] & PTE_VALID)) {
+            continue;
+        }
+        u64 addr = va + ((u64)i << (39 - 9 * level));
+        if (level < 3) {
+            if (!copy_table(dst, (PTEntriesPtr)P2K(PTE_ADDRESS(pt[i])), level + 1,
+                            addr, tlb)) {
+                return false;
+            }
+            continue;
+        }
+
+        PTEntriesPtr pte = get_pte(dst, addr, true);
+        if (!pte) {
+            printk("PANIC: cannot alloc page table for %llx\n", addr);
+            return false;
+        }
+        // Writable pages turn read-only in both until someone writes
+        if (!(pt[i] & PTE_RO)) {
+            pt[i] |= PTE_RO | PTE_COW;
+            tlb_gather_page(tlb, addr);
+        }
+        get_page((void *)P2K(PTE_ADDRESS(pt[i])));
+        *pte = pt[i];
+    }
+    return true;
+}
+
+// Give the empty `dst` the regions of `src`. Untouched pages of the
+// anonymous regions stay lazy in `dst` as well.
+static bool copy_regions(struct pgdir *dst, struct pgdir *src)
+{
+    for (struct anon_region *r = src->regions; r; r = r->next) {
+        struct anon_region *region = kalloc(sizeof(struct anon_region));
+        if (!region) {
+            printk("PANIC: cannot alloc region for %llx\n", r->start);
+            return false;
+        }
+        *region = *r;
+        region->next = dst->regions;
+        dst->regions = region;
+    }
+    return true;
+}
+
+bool pgdir_copy(struct pgdir *dst, struct pgdir *src)
+{
+    // Faults on `src` change the same entries
+    acquire_spinlock(&src->lock);
+    acquire_spinlock(&dst->lock);
+    bool ok = copy_regions(dst, src);
+    if (ok && src->pt) {
+        struct tlb_gather tlb;
+        tlb_gather_init(&tlb, src);
+        ok = copy_table(dst, src->pt, 0, 0, &tlb);
+        tlb_flush(&tlb);
+    }
+    release_spinlock(&dst->lock);
+    release_spinlock(&src->lock);
+
+    if (!ok) {
+        // Drops the references taken so far. `src` keeps its pages
+        // copy-on-write, which the next write fault undoes.
+        free_pgdir(dst);
+    }
+    return ok;
+}
+
+// Must be called with `pgdir->lock` held
+static bool cow_fault(struct pgdir *pgdir, u64 va)
+{
+    PTEntriesPtr pte = get_pte(pgdir, va, false);
+    if (!pte || !(*pte & PTE_VALID) || !(*pte & PTE_COW)) {
+        return false;
+    }
+
+    void *old = (void *)P2K(PTE_ADDRESS(*pte));
+    u64 flags = PTE_FLAGS(*pte) & ~(PTE_RO | PTE_COW);
+    if (page_refcount(old) == 1) {
+        // The other sharers are gone, the page is ours
+        *pte = K2P(old) | flags;
+    } else {
+        void *copy = kalloc_page();
+        if (!copy) {
+            printk("PANIC: cannot alloc page for copy-on-write at %llx\n", va);
+            return false;
+        }
+        if (old == zero_page) {
+            memset(copy, 0, PAGE_SIZE);
+        } else {
+            memcpy(copy, old, PAGE_SIZE);
+        }
+        *pte = K2P(copy) | flags;
+    }
+
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, pgdir);
+    tlb_gather_page(&tlb, va);
+    if (K2P(old) != PTE_ADDRESS(*pte)) {
+        // Not before the TLB has let go of it
+        tlb_gather_free(&tlb, old);
+    }
+    tlb_flush(&tlb);
+    return true;
+}
+
+bool pgdir_cow_fault(struct pgdir *pgdir, u64 va)
+{
+    acquire_spinlock(&pgdir->lock);
+    bool ok = cow_fault(pgdir, va);
+    release_spinlock(&pgdir->lock);
+    return ok;
+}
+
+bool pgdir_add_anon(struct pgdir *pgdir, u64 va, u64 size, u64 flags)
+{
+    u64 start = PAGE_BASE(va);
+    u64 end = PAGE_BASE((va + size + PAGE_SIZE - 1));
+    if (start >= end) {
+        return false;
+    }
+
+    struct anon_region *region = kalloc(sizeof(struct anon_region));
+    if (!region) {
+        printk("PANIC: cannot alloc region for %llx\n", va);
+        return false;
+    }
+    region->start = start;
+    region->end = end;
+    region->flags = flags;
+
+    acquire_spinlock(&pgdir->lock);
+    for (struct anon_region *r = pgdir->regions; r; r = r->next) {
+        if (start < r->end && r->start < end) {
+            release_spinlock(&pgdir->lock);
+            kfree(region);
+            return false;
+        }
+    }
+    region->next = pgdir->regions;
+    pgdir->regions = region;
+    release_spinlock(&pgdir->lock);
+    return true;
+}
+
+static struct anon_region *find_region(struct pgdir *pgdir, u64 va)
+{
+    for (struct anon_region *r = pgdir->regions; r; r = r->next) {
+        if (r->start <= va && va < r->end) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+// Must be called with `pgdir->lock` held
+static bool anon_fault(struct pgdir *pgdir, u64 va, bool write)
+{
+    struct anon_region *region = find_region(pgdir, va);
+    if (!region || (write && (region->flags & PTE_RO))) {
+        return false;
+    }
+
+    PTEntriesPtr pte = get_pte(pgdir, va, true);
+    if (!pte) {
+        printk("PANIC: cannot alloc page table for %llx\n", va);
+        return false;
+    }
+    if (*pte & PTE_VALID) {
+        // Another CPU got here first
+        return true;
+    }
+
+    // The entry was invalid, so there is nothing to flush from the TLB
+    if (!write && zero_page) {
+        get_page(zero_page);
+        // Only writable regions may get a page of their own later
+        u64 cow = region->flags & PTE_RO ? 0 : PTE_COW;
+        *pte = K2P(zero_page) | region->flags | PTE_RO | cow;
+        return true;
+    }
+
+    void *page = kalloc_page();
+    if (!page) {
+        printk("PANIC: cannot alloc page for %llx\n", va);
+        return false;
+    }
+    memset(page, 0, PAGE_SIZE);
+    *pte = K2P(page) | region->flags;
+    return true;
+}
+
+bool pgdir_handle_fault(struct pgdir *pgdir, u64 va, bool write)
+{
+    va = PAGE_BASE(va);
+    acquire_spinlock(&pgdir->lock);
+
+    bool ok;
+    PTEntriesPtr pte = get_pte(pgdir, va, false);
+    if (pte && (*pte & PTE_VALID)) {
+        if (write && (*pte & PTE_RO)) {
+            ok = cow_fault(pgdir, va);
+        } else {
+            // Another CPU resolved the same fault first. Elsewhere this is
+            // a genuine permission fault.
+            ok = find_region(pgdir, va) != NULL;
+        }
+    } else {
+        ok = anon_fault(pgdir, va, write);
+    }
+
+    release_spinlock(&pgdir->lock);
+    return ok;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <aarch64/mmu.h>
+#include <common/spinlock.h>
+
+// Anonymous memory reserved by pgdir_add_anon(). Its pages are only
+// allocated when they are first touched.
+struct anon_region {
+    u64 start, end;
+    // Page attributes, e.g. PTE_USER_DATA
+    u64 flags;
+    struct anon_region *next;
+};
+
+// A user address space, installed in TTBR0. The kernel lives in TTBR1.
+struct pgdir {
+    // Level-0 table, NULL until the first mapping
+    PTEntriesPtr pt;
+    // ASID generation << 16 | ASID, 0 if the address space has none yet
+    u64 asid;
+    // Serialises page faults, maps, unmaps, copies and changes to `regions`
+    SpinLock lock;
+    struct anon_region *regions;
+};
+
+// Set up the zero page, after kinit()
+void init_pt();
+
+void init_pgdir(struct pgdir *pgdir);
+// Free the page tables and drop the references of the pages they map. The
+// address space must not be attached on any CPU.
+void free_pgdir(struct pgdir *pgdir);
+// Switch the calling CPU to `pgdir`, without flushing the TLB
+void attach_pgdir(struct pgdir *pgdir);
+// Address space attached on the calling CPU, or NULL
+struct pgdir *current_pgdir();
+
+// Return the level-3 entry for `va`, or NULL if a table on the way is
+// missing and `alloc` is false or the allocation fails. Faults may change
+// the tables meanwhile unless `pgdir->lock` is held.
+PTEntriesPtr get_pte(struct pgdir *pgdir, u64 va, bool alloc);
+
+// Map the pages [va, va + size) to [pa, pa + size). `flags` are the page
+// attributes, e.g. PTE_USER_DATA. The pages must come from kalloc_page(),
+// and every mapping holds a reference of its own, dropped when it goes
+// away. Takes `pgdir->lock`, so faults on other CPUs see either the old or
+// the new mappings. Returns false if a table cannot be allocated.
+bool pgdir_map(struct pgdir *pgdir, u64 va, u64 pa, u64 size, u64 flags);
+// Remove the mappings of [va, va + size) and drop their page references.
+// Takes `pgdir->lock`.
+void pgdir_unmap(struct pgdir *pgdir, u64 va, u64 size);
+
+// Map every page of the empty `dst` as in `src`, sharing them
+// copy-on-write. Takes the lock of `src`, then of `dst`, so `dst` must not
+// be in use elsewhere yet. Returns false if a table cannot be allocated,
+// with `dst` left empty.
+bool pgdir_copy(struct pgdir *dst, struct pgdir *src);
+// Resolve a write fault at `va`: give the page its own copy, or make it
+// writable again if no one else shares it. Returns false if `va` is not a
+// copy-on-write page.
+bool pgdir_cow_fault(struct pgdir *pgdir, u64 va);
+
+// Reserve [va, va + size) as anonymous, zero-filled memory mapped with
+// `flags`. Nothing is allocated up front: reads map the shared zero page
+// until the first write, writes get a page of their own. Returns false if
+// the range overlaps another region or the bookkeeping cannot be allocated.
+bool pgdir_add_anon(struct pgdir *pgdir, u64 va, u64 size, u64 flags);
+// Resolve a fault at `va`. Returns false if the access is not allowed, so
+// the fault is a real one.
+bool pgdir_handle_fault(struct pgdir *pgdir, u64 va, bool write);
+
+// Pages an unmap may hold back before it has to flush
+#define TLB_GATHER_PAGES 32
+
+// Collects the pages whose mappings changed, so that their TLB entries are
+// invalidated in one go by tlb_flush()
+struct tlb_gather {
+    struct pgdir *pgdir;
+    // Page range touched so far, empty if start == end
+    u64 start, end;
+    // References to drop once the TLB can no longer reach the pages
+    void *pages[TLB_GATHER_PAGES];
+    int nr_pages;
+};
+
+void tlb_gather_init(struct tlb_gather *tlb, struct pgdir *pgdir);
+void tlb_gather_page(struct tlb_gather *tlb, u64 va);
+// Drop a reference to `page` after the next flush
+void tlb_gather_free(struct tlb_gather *tlb, void *page);
+void tlb_flush(struct tlb_gather *tlb);
@@ -0,0 +1,323 @@
+#include <aarch64/intrinsic.h>
+#include <aarch64/mmu.h>
+#include <common/spinlock.h>
+#include <common/string.h>
+#include <driver/gicv3.h>
+#include <driver/interrupt.h>
+#include <kernel/mem.h>
+#include <kernel/percpu.h>
+#include <kernel/printk.h>
+#include <kernel/sched.h>
+#include <kernel/timer.h>
+
+// SGI that wakes an idle CPU up when there is work for it
+#define RESCHED_SGI 0
+
+// Every CPU schedules from its own run queue, so the common path takes no
+// shared lock. A CPU whose queue is empty steals from the others.
+struct runqueue {
+    SpinLock lock;
+    // RUNNABLE threads, oldest first
+    ListNode threads;
+    int nr;
+};
+
+static DEFINE_PER_CPU(struct runqueue, runqueue);
+static DEFINE_PER_CPU(struct thread, idle_thread);
+static DEFINE_PER_CPU(struct thread *, current_thread);
+// Thread switched away from, for finish_switch() on the other side
+static DEFINE_PER_CPU(struct thread *, prev_thread);
+// Set by the end of a time slice or a kick, acted on by preempt()
+static DEFINE_PER_CPU(bool, need_resched);
+// Ends the time slice of the running thread. Idle CPUs leave it off.
+static DEFINE_PER_CPU(struct timer, slice_timer);
+// CPUs about to wait in the idle loop, one bit each
+static volatile u32 idle_cpus;
+
+void swtch(KernelContext **old, KernelContext *new);
+void thread_trampoline();
+
+static void slice_end(struct timer *t)
+{
+    (void)t;
+    this_cpu(need_resched) = true;
+}
+
+static void resched_interrupt()
+{
+    this_cpu(need_resched) = true;
+}
+
+void init_sched()
+{
+    for (int i = 0; i < NCPU; i++) {
+        struct runqueue *rq = per_cpu_ptr(runqueue, i);
+        init_spinlock(&rq->lock);
+        init_list_node(&rq->threads);
+        rq->nr = 0;
+
+        struct thread *idle = per_cpu_ptr(idle_thread, i);
+        idle->state = RUNNING;
+        idle->idle = true;
+        init_list_node(&idle->node);
+        init_timer(per_cpu_ptr(slice_timer, i), slice_end, 0);
+        per_cpu(current_thread, i) = idle;
+    }
+    set_interrupt_handler(RESCHED_SGI, resched_interrupt);
+}
+
+struct thread *thisthread()
+{
+    return this_cpu(current_thread);
+}
+
+// Get an idle CPU to pick up new work, the one owning the queue if it is
+// idle. The idle loop sets its bit before it looks at the queues for the
+// last time, so either it sees the work or we see the bit.
+static void kick_idle_cpu(int cpu)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    u32 idle = idle_cpus & ~(1u << cpuid());
+    if (!idle) {
+        return;
+    }
+    int target = idle & (1u << cpu) ? cpu : __builtin_ctz(idle);
+    gicv3_send_sgi(target, RESCHED_SGI);
+}
+
+static void enqueue(int cpu, struct thread *t)
+{
+    struct runqueue *rq = per_cpu_ptr(runqueue, cpu);
+    acquire_spinlock(&rq->lock);
+    _insert_into_list(rq->threads.prev, &t->node);
+    rq->nr++;
+    release_spinlock(&rq->lock);
+
+    // An idle CPU queueing for itself does so from an interrupt, and
+    // switches once the handler is done
+    if (thisthread()->idle) {
+        this_cpu(need_resched) = true;
+    }
+    kick_idle_cpu(cpu);
+}
+
+static struct thread *dequeue(struct runqueue *rq)
+{
+    // Racy peek, so that idle CPUs do not hammer each other's locks
+    if (!rq->nr) {
+        return NULL;
+    }
+    struct thread *t = NULL;
+    acquire_spinlock(&rq->lock);
+    if (rq->nr) {
+        ListNode *node = rq->threads.next;
+        _detach_from_list(node);
+        rq->nr--;
+        t = container_of(node, struct thread, node);
+    }
+    release_spinlock(&rq->lock);
+    return t;
+}
+
+static struct thread *pick_next()
+{
+    int cpu = cpuid();
+    struct thread *t = dequeue(per_cpu_ptr(runqueue, cpu));
+    for (int i = 1; !t && i < NCPU; i++) {
+        t = dequeue(per_cpu_ptr(runqueue, (cpu + i) % NCPU));
+    }
+    return t;
+}
+
+struct thread *create_thread(void (*entry)(u64), u64 arg)
+{
+    struct thread *t = kalloc(sizeof(struct thread));
+    if (!t) {
+        return NULL;
+    }
+    t->stack = kalloc_pages(THREAD_STACK_ORDER);
+    if (!t->stack) {
+        printk("PANIC: cannot alloc thread stack\n");
+        kfree(t);
+        return NULL;
+    }
+
+    // swtch() into the new stack returns to thread_trampoline()
+    KernelContext *ctx =
+            (KernelContext *)((u64)t->stack + (PAGE_SIZE << THREAD_STACK_ORDER)) -
+            1;
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->x19 = (u64)entry;
+    ctx->x20 = arg;
+    ctx->lr = (u64)thread_trampoline;
+    t->context = ctx;
+    t->state = RUNNABLE;
+    t->idle = false;
+    init_list_node(&t->node);
+
+    enqueue(cpuid(), t);
+    return t;
+}
+
+// Runs first thing on the new stack. The previous thread is queued or freed
+// only now: until swtch() is done with its stack, another CPU must not pick
+// it up.
+static void finish_switch()
+{
+    struct thread *prev = this_cpu(prev_thread);
+    this_cpu(prev_thread) = NULL;
+    if (prev->idle) {
+        return;
+    }
+    if (prev->state == RUNNABLE) {
+        enqueue(cpuid(), prev);
+    } else if (prev->state == DEAD) {
+        kfree_pages(prev->stack, THREAD_STACK_ORDER);
+        kfree(prev);
+    }
+}
+
+// Give `t` a fresh time slice, or none if it is the idle thread: an idle
+// CPU sleeps until an interrupt that matters
+static void start_slice(struct thread *t)
+{
+    struct timer *slice = this_cpu_ptr(slice_timer);
+    if (t->idle) {
+        cancel_timer(slice);
+    } else {
+        set_timer(slice, get_timestamp() + us_to_ticks(SCHED_TICK_MS * 1000));
+    }
+}
+
+// Switch to the next thread, with interrupts off through a single
+// push_off(). The caller sets the state of the current thread: a RUNNING
+// one keeps the CPU if no one else is waiting.
+static void sched()
+{
+    struct thread *prev = thisthread();
+    struct thread *next = pick_next();
+    if (!next) {
+        if (prev->state == RUNNING) {
+            start_slice(prev);
+            return;
+        }
+        next = this_cpu_ptr(idle_thread);
+    }
+    start_slice(next);
+    if (prev->state == RUNNING) {
+        prev->state = RUNNABLE;
+    }
+
+    next->state = RUNNING;
+    this_cpu(current_thread) = next;
+    this_cpu(prev_thread) = prev;
+    // Whether interrupts come back belongs to the thread, not the CPU
+    bool intena = get_intena();
+    swtch(&prev->context, next->context);
+    finish_switch();
+    set_intena(intena);
+}
+
+NO_RETURN void thread_start(void (*entry)(u64), u64 arg)
+{
+    finish_switch();
+    set_intena(true);
+    pop_off();
+    entry(arg);
+    thread_exit();
+}
+
+void yield()
+{
+    push_off();
+    sched();
+    pop_off();
+}
+
+NO_RETURN void thread_exit()
+{
+    push_off();
+    thisthread()->state = DEAD;
+    sched();
+    printk("PANIC: dead thread scheduled\n");
+    arch_stop_cpu();
+}
+
+void preempt()
+{
+    if (this_cpu(need_resched)) {
+        this_cpu(need_resched) = false;
+        yield();
+    }
+}
+
+static void wake_up(struct timer *t)
+{
+    wake_thread((struct thread *)t->data);
+}
+
+void wake_thread(struct thread *t)
+{
+    push_off();
+    t->state = RUNNABLE;
+    enqueue(cpuid(), t);
+    pop_off();
+}
+
+void sleep_until(u64 deadline)
+{
+    struct thread *t = thisthread();
+    struct timer timer;
+    init_timer(&timer, wake_up, (u64)t);
+    push_off();
+    t->state = SLEEPING;
+    // The timer fires on this CPU, and so not before it has switched away
+    if (set_timer(&timer, deadline)) {
+        sched();
+        pop_off();
+        return;
+    }
+
+    // Every timer of this CPU is taken, wait without one
+    t->state = RUNNING;
+    pop_off();
+    while (get_timestamp() < deadline) {
+        arch_yield();
+    }
+}
+
+void delay_sleep(u64 deadline)
+{
+    // Interrupts on means no spinlock is held and no handler is running
+    if (arch_get_daif() == 0 && !thisthread()->idle) {
+        sleep_until(deadline);
+    }
+}
+
+static bool any_runnable()
+{
+    for (int i = 0; i < NCPU; i++) {
+        if (per_cpu_ptr(runqueue, i)->nr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+NO_RETURN void sched_start()
+{
+    start_timers();
+    gicv3_enable_ppi(RESCHED_SGI);
+    _arch_enable_trap();
+    u32 bit = 1u << cpuid();
+    while (1) {
+        yield();
+        // No timer ticks here: sleep until a timer is due or another CPU
+        // kicks us, see kick_idle_cpu()
+        __atomic_fetch_or(&idle_cpus, bit, __ATOMIC_SEQ_CST);
+        if (!any_runnable()) {
+            arch_wfi();
+        }
+        __atomic_fetch_and(&idle_cpus, ~bit, __ATOMIC_SEQ_CST);
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <common/defines.h>
+#include <common/list.h>
+
+// Callee-saved registers, pushed on a thread's stack by swtch()
+typedef struct {
+    u64 x19, x20, x21, x22, x23, x24, x25, x26, x27, x28;
+    u64 fp, lr;
+} KernelContext;
+
+enum thread_state {
+    RUNNABLE,
+    RUNNING,
+    // Off the run queues until wake_thread()
+    SLEEPING,
+    DEAD,
+};
+
+struct thread {
+    // Where swtch() left off, while not running
+    KernelContext *context;
+    enum thread_state state;
+    // Idle threads run on the boot stacks, one per CPU, and are never queued
+    bool idle;
+    void *stack;
+    // Link in a run queue while RUNNABLE
+    ListNode node;
+};
+
+// Time slice, in milliseconds. Only CPUs with a thread to run count it.
+#define SCHED_TICK_MS 10
+// Kernel stacks are 2^THREAD_STACK_ORDER pages
+#define THREAD_STACK_ORDER 1
+
+// Set up the run queues and idle threads, on CPU 0 after init_percpu()
+void init_sched();
+// Create a thread running entry(arg), queued on the calling CPU. It exits
+// when `entry` returns.
+struct thread *create_thread(void (*entry)(u64), u64 arg);
+struct thread *thisthread();
+// Give up the CPU to the next runnable thread, if any. Must not be called
+// with a spinlock held.
+void yield();
+NO_RETURN void thread_exit();
+// Make a SLEEPING thread runnable, queued on the calling CPU
+void wake_thread(struct thread *t);
+// Sleep until get_timestamp() reaches `deadline`. Must be called with
+// interrupts on. Spins instead if the CPU has NR_TIMERS set already.
+void sleep_until(u64 deadline);
+// Yield if the timer or another CPU asked for it, called at the end of IRQs
+void preempt();
+// Make the calling CPU's boot context its idle thread and start the timers.
+// The idle thread waits in wfi with no tick until there is work.
+NO_RETURN void sched_start();
@@ -0,0 +1,188 @@
+#include <aarch64/intrinsic.h>
+#include <common/spinlock.h>
+#include <driver/clock.h>
+#include <kernel/percpu.h>
+#include <kernel/printk.h>
+#include <kernel/timer.h>
+
+struct timer_heap {
+    // Only the owning CPU sets timers, but any CPU may cancel one
+    SpinLock lock;
+    int nr;
+    // heap[0] has the earliest deadline
+    struct timer *heap[NR_TIMERS];
+};
+
+static DEFINE_PER_CPU(struct timer_heap, timer_heap);
+
+void init_timers()
+{
+    for (int i = 0; i < NCPU; i++) {
+        struct timer_heap *h = per_cpu_ptr(timer_heap, i);
+        init_spinlock(&h->lock);
+        h->nr = 0;
+    }
+}
+
+void init_timer(struct timer *t, void (*handler)(struct timer *), u64 data)
+{
+    t->deadline = 0;
+    t->handler = handler;
+    t->data = data;
+    t->index = -1;
+    t->cpu = -1;
+}
+
+u64 us_to_ticks(u64 us)
+{
+    return get_clock_frequency() / 1000000 * us;
+}
+
+static void heap_place(struct timer_heap *h, int i, struct timer *t)
+{
+    h->heap[i] = t;
+    t->index = i;
+}
+
+static void sift_up(struct timer_heap *h, int i)
+{
+    struct timer *t = h->heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (h->heap[parent]->deadline <= t->deadline) {
+            break;
+        }
+        heap_place(h, i, h->heap[parent]);
+        i = parent;
+    }
+    heap_place(h, i, t);
+}
+
+static void sift_down(struct timer_heap *h, int i)
+{
+    struct timer *t = h->heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= h->nr) {
+            break;
+        }
+        if (child + 1 < h->nr &&
+            h->heap[child + 1]->deadline < h->heap[child]->deadline) {
+            child++;
+        }
+        if (t->deadline <= h->heap[child]->deadline) {
+            break;
+        }
+        heap_place(h, i, h->heap[child]);
+        i = child;
+    }
+    heap_place(h, i, t);
+}
+
+static void heap_remove(struct timer_heap *h, struct timer *t)
+{
+    int i = t->index;
+    struct timer *last = h->heap[--h->nr];
+    t->index = -1;
+    if (last == t) {
+        return;
+    }
+    // The last timer fills the hole and moves whichever way it has to
+    heap_place(h, i, last);
+    sift_up(h, i);
+    sift_down(h, last->index);
+}
+
+// Point the hardware at the earliest deadline, on the CPU owning `h`
+static void program_clock(struct timer_heap *h)
+{
+    if (h->nr) {
+        set_clock_deadline(h->heap[0]->deadline);
+    } else {
+        stop_clock();
+    }
+}
+
+bool set_timer(struct timer *t, u64 deadline)
+{
+    // The heap, `t->cpu` and the clock programmed must all be of one CPU
+    push_off();
+    if (timer_pending(t)) {
+        cancel_timer(t);
+    }
+
+    int cpu = cpuid();
+    struct timer_heap *h = per_cpu_ptr(timer_heap, cpu);
+    acquire_spinlock(&h->lock);
+    if (h->nr == NR_TIMERS) {
+        release_spinlock(&h->lock);
+        pop_off();
+        printk("PANIC: CPU %d: too many timers\n", cpu);
+        return false;
+    }
+    t->deadline = deadline;
+    t->cpu = cpu;
+    h->heap[h->nr] = t;
+    sift_up(h, h->nr++);
+    if (h->heap[0] == t) {
+        program_clock(h);
+    }
+    release_spinlock(&h->lock);
+    pop_off();
+    return true;
+}
+
+void cancel_timer(struct timer *t)
+{
+    push_off();
+    for (;;) {
+        int cpu = __atomic_load_n(&t->cpu, __ATOMIC_RELAXED);
+        if (cpu < 0) {
+            break;
+        }
+        struct timer_heap *h = per_cpu_ptr(timer_heap, cpu);
+        acquire_spinlock(&h->lock);
+        if (t->cpu != cpu) {
+            // Set again on another CPU meanwhile, look there
+            release_spinlock(&h->lock);
+            continue;
+        }
+        if (timer_pending(t)) {
+            heap_remove(h, t);
+            // Another CPU's clock cannot be reached from here. It fires
+            // early at worst, and timer_interrupt() finds nothing due.
+            if (cpu == (int)cpuid()) {
+                program_clock(h);
+            }
+        }
+        release_spinlock(&h->lock);
+        break;
+    }
+    pop_off();
+}
+
+static void timer_interrupt()
+{
+    struct timer_heap *h = this_cpu_ptr(timer_heap);
+    acquire_spinlock(&h->lock);
+    // Everything due by now, including what came due while handlers ran
+    while (h->nr && h->heap[0]->deadline <= get_timestamp()) {
+        struct timer *t = h->heap[0];
+        heap_remove(h, t);
+        // Handlers may set timers, this one included
+        release_spinlock(&h->lock);
+        t->handler(t);
+        acquire_spinlock(&h->lock);
+    }
+    program_clock(h);
+    release_spinlock(&h->lock);
+}
+
+void start_timers()
+{
+    init_clock(timer_interrupt);
+    struct timer_heap *h = this_cpu_ptr(timer_heap);
+    acquire_spinlock(&h->lock);
+    program_clock(h);
+    release_spinlock(&h->lock);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <common/defines.h>
+
+// One-shot timers. Every CPU keeps the timers set on it in a min-heap by
+// deadline and programs the EL1 physical timer for the earliest one only,
+// so a CPU with nothing due takes no timer interrupts at all.
+struct timer {
+    // In get_timestamp() ticks
+    u64 deadline;
+    // Runs in interrupt context, on the CPU the timer was set on
+    void (*handler)(struct timer *);
+    u64 data;
+    // Position in the heap of `cpu`, -1 while not set
+    int index;
+    int cpu;
+};
+
+// Timers one CPU can have set at a time. Beyond that set_timer() fails,
+// and sleep_until() spins rather than sleep.
+#define NR_TIMERS 64
+
+// Set up the heaps of all CPUs, on CPU 0 after init_percpu()
+void init_timers();
+// Take the timer interrupt of the calling CPU
+void start_timers();
+void init_timer(struct timer *t, void (*handler)(struct timer *), u64 data);
+// Run `t` on the calling CPU at `deadline`, moving it if it is already set.
+// Returns false if the CPU has NR_TIMERS set already.
+bool set_timer(struct timer *t, u64 deadline);
+// Take `t` out if it is set. A handler already running is not waited for.
+void cancel_timer(struct timer *t);
+static ALWAYS_INLINE bool timer_pending(struct timer *t)
+{
+    return t->index >= 0;
+}
+u64 us_to_ticks(u64 us);
@@ -0,0 +1,105 @@
+#include <aarch64/intrinsic.h>
+#include <common/spinlock.h>
+#include <driver/interrupt.h>
+#include <kernel/percpu.h>
+#include <kernel/printk.h>
+#include <kernel/pt.h>
+#include <kernel/sched.h>
+#include <kernel/trap.h>
+
+extern char exception_vector[];
+
+// Depth of push_off(), and whether interrupts were on before the first one
+static DEFINE_PER_CPU(int, noff);
+static DEFINE_PER_CPU(bool, intena);
+
+void push_off()
+{
+    // Interrupts must be off before touching the per-CPU state
+    bool enabled = _arch_disable_trap();
+    if (this_cpu(noff)++ == 0) {
+        this_cpu(intena) = enabled;
+    }
+}
+
+void pop_off()
+{
+    if (--this_cpu(noff) == 0 && this_cpu(intena)) {
+        _arch_enable_trap();
+    }
+}
+
+bool get_intena()
+{
+    return this_cpu(intena);
+}
+
+void set_intena(bool enabled)
+{
+    this_cpu(intena) = enabled;
+}
+
+void init_trap()
+{
+    arch_set_vbar(exception_vector);
+    arch_reset_esr();
+}
+
+// Page faults on the attached address space, see pgdir_handle_fault()
+static bool handle_abort(u64 esr, u64 far)
+{
+    u64 ec = esr >> ESR_EC_SHIFT;
+    u64 iss = esr & ESR_ISS_MASK;
+    u64 fsc = ESR_FSC(iss);
+    if (fsc != ESR_FSC_TRANSLATION && fsc != ESR_FSC_PERMISSION) {
+        return false;
+    }
+
+    struct pgdir *pgdir = current_pgdir();
+    if (!pgdir) {
+        return false;
+    }
+
+    bool write = (ec == ESR_EC_DABORT_EL0 || ec == ESR_EC_DABORT_EL1) &&
+                 (iss & ESR_ISS_WNR);
+    return pgdir_handle_fault(pgdir, far, write);
+}
+
+void trap_global_handler(UserContext *context)
+{
+    u64 esr = arch_get_esr();
+    u64 far = arch_get_far();
+    arch_reset_esr();
+
+    switch (esr >> ESR_EC_SHIFT) {
+    case ESR_EC_IABORT_EL0:
+    case ESR_EC_IABORT_EL1:
+    case ESR_EC_DABORT_EL0:
+    case ESR_EC_DABORT_EL1:
+        if (handle_abort(esr, far)) {
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+
+    printk("PANIC: CPU %lld: unhandled exception, esr %llx, elr %llx, far %llx\n",
+           cpuid(), esr, context->elr, far);
+    arch_stop_cpu();
+}
+
+void trap_irq_handler(UserContext *context)
+{
+    (void)context;
+    interrupt_global_handler();
+    // The interrupted thread resumes from here once it is picked again
+    preempt();
+}
+
+void trap_invalid_handler(UserContext *context)
+{
+    printk("PANIC: CPU %lld: unexpected exception, esr %llx, elr %llx\n",
+           cpuid(), arch_get_esr(), context->elr);
+    arch_stop_cpu();
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <common/defines.h>
+
+// Registers saved by the exception vectors in aarch64/trap.S
+typedef struct {
+    u64 x[31];
+    u64 elr;
+    u64 spsr;
+    u64 sp_el0;
+} UserContext;
+
+// Exception Syndrome Register fields
+#define ESR_EC_SHIFT 26
+#define ESR_EC_IABORT_EL0 0x20
+#define ESR_EC_IABORT_EL1 0x21
+#define ESR_EC_DABORT_EL0 0x24
+#define ESR_EC_DABORT_EL1 0x25
+#define ESR_ISS_MASK 0x1ffffff
+// Data abort: the access was a write
+#define ESR_ISS_WNR (1 << 6)
+// Fault status code of aborts, levels 0..3 in the low two bits
+#define ESR_FSC(iss) ((iss) & 0x3c)
+#define ESR_FSC_TRANSLATION 0x4
+#define ESR_FSC_PERMISSION 0xc
+
+// Install the exception vectors on the calling CPU
+void init_trap();
+
+void trap_global_handler(UserContext *context);
+void trap_irq_handler(UserContext *context);
+void trap_invalid_handler(UserContext *context);
@@ -1,9 +1,16 @@
 #include <aarch64/intrinsic.h>
+#include <aarch64/mmu.h>
 #include <common/string.h>
+#include <driver/gicv3.h>
 #include <driver/uart.h>
 #include <kernel/core.h>
 #include <kernel/mem.h>
+#include <kernel/percpu.h>
 #include <kernel/printk.h>
+#include <kernel/pt.h>
+#include <kernel/sched.h>
+#include <kernel/timer.h>
+#include <kernel/trap.h>
 
 static volatile bool boot_secondary_cpus = false;
 
@@ -12,6 +19,7 @@ void main() {
         /* @todo: Clear BSS section.*/
         extern char edata[], end[];
         memset(edata, 0, (usize)(end - edata));
+        init_percpu();
 
         smp_init();
         uart_init();
@@ -19,6 +27,10 @@ void main() {
 
         /* initialize kernel memory allocator */
         kinit();
+        init_pt();
+        gicv3_init();
+        init_timers();
+        init_sched();
 
         arch_fence();
 
@@ -27,7 +39,12 @@ void main() {
     } else {
         while (!boot_secondary_cpus);
         arch_fence();
+        percpu_install();
+        kernel_pt_install();
     }
 
+    init_trap();
+    gicv3_init_percpu();
+
     set_return_addr(idle_entry);
 }
@@ -0,0 +1,211 @@
+#include <aarch64/intrinsic.h>
+#include <aarch64/mmu.h>
+#include <common/string.h>
+#include <kernel/mem.h>
+#include <kernel/printk.h>
+#include <test/test.h>
+#include <test/test_util.h>
+
+// As in kernel/mem.c: kalloc_pages() takes orders 0..MAX_ORDER - 1
+#define MAX_ORDER 11
+// Blocks of every order held at once
+#define PER_ORDER 3
+
+static void *blocks[MAX_ORDER][PER_ORDER];
+
+static u8 fill_of(int order, int i) {
+    return (u8)(order * PER_ORDER + i + 1);
+}
+
+// Blocks of every order are aligned to their size and do not overlap
+static void orders_test() {
+    for (int order = 0; order < MAX_ORDER; order++) {
+        for (int i = 0; i < PER_ORDER; i++) {
+            void *p = kalloc_pages(order);
+            if (!p || K2P(p) % (PAGE_SIZE << order))
+                FAIL("FAIL: kalloc_pages(%d) = %p\n", order, p);
+            memset(p, fill_of(order, i), PAGE_SIZE << order);
+            blocks[order][i] = p;
+        }
+    }
+    if (kalloc_pages(MAX_ORDER) || kalloc_pages(-1))
+        FAIL("FAIL: kalloc_pages() took an order out of range\n");
+
+    // An overlap shows up as a block overwritten by a later one
+    for (int order = 0; order < MAX_ORDER; order++) {
+        for (int i = 0; i < PER_ORDER; i++) {
+            u8 *p = blocks[order][i];
+            for (int k = 0; k < (PAGE_SIZE << order); k += 64)
+                if (p[k] != fill_of(order, i))
+                    FAIL("FAIL: order %d block %p overwritten at %x\n", order, p, k);
+            kfree_pages(p, order);
+        }
+    }
+}
+
+// Blocks freed in pieces merge back into whole ones
+static void merge_test() {
+    // Use up the largest blocks, linked through their first word
+    void *held = NULL;
+    int n = 0;
+    for (void *p; (p = kalloc_pages(MAX_ORDER - 1)); n++) {
+        *(void **)p = held;
+        held = p;
+    }
+    if (!held)
+        FAIL("FAIL: no block of order %d\n", MAX_ORDER - 1);
+
+    // Only merging all the way up makes another one
+    u8 *top = held;
+    held = *(void **)top;
+    for (usize k = 0; k < (1ull << (MAX_ORDER - 1)); k += 2)
+        kfree_pages(top + k * PAGE_SIZE, 1);
+    void *again = kalloc_pages(MAX_ORDER - 1);
+    if (again != top)
+        FAIL("FAIL: order-1 pieces of %p merged into %p\n", top, again);
+    kfree_pages(top, MAX_ORDER - 1);
+
+    while (held) {
+        void *next = *(void **)held;
+        kfree_pages(held, MAX_ORDER - 1);
+        held = next;
+    }
+    printk("merge: %d blocks of order %d\n", n, MAX_ORDER - 1);
+}
+
+// Sizes past the largest kalloc tier, which get whole pages
+static const usize large_sizes[] = {
+    2049, PAGE_SIZE, PAGE_SIZE + 1, 3 * PAGE_SIZE, 5 * PAGE_SIZE - 8, 17 * PAGE_SIZE + 100,
+};
+#define NR_LARGE (int)(sizeof(large_sizes) / sizeof(large_sizes[0]))
+
+// Large objects take just the pages they need, the rest of their block
+// goes back at once
+static void large_test() {
+    void *objects[NR_LARGE];
+    isize used = kalloc_page_count(), pages = 0;
+    for (int i = 0; i < NR_LARGE; i++) {
+        usize size = large_sizes[i];
+        objects[i] = kalloc(size);
+        if (!objects[i] || K2P(objects[i]) % PAGE_SIZE)
+            FAIL("FAIL: kalloc(%llu) = %p\n", size, objects[i]);
+        memset(objects[i], i + 1, size);
+        pages += (size + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (kalloc_page_count() - used != pages)
+            FAIL("FAIL: kalloc(%llu) holds %lld pages, not %lld\n", size,
+                 kalloc_page_count() - used, pages);
+    }
+    for (int i = 0; i < NR_LARGE; i++) {
+        u8 *p = objects[i];
+        for (usize k = 0; k < large_sizes[i]; k++)
+            if (p[k] != i + 1)
+                FAIL("FAIL: kalloc(%llu) overwritten at %llu\n", large_sizes[i], k);
+        kfree(p);
+    }
+    if (kalloc_page_count() != used)
+        FAIL("FAIL: large objects kept %lld pages\n", kalloc_page_count() - used);
+}
+
+// Odd-sized, so that the slab pages have room left to colour with
+struct object {
+    u64 magic;
+    u32 uses;
+    u8 payload[288];
+};
+
+#define OBJECT_MAGIC 0x6f626a6563740a00ull
+#define OBJECT_ALIGN 64
+// Enough for a few slab pages
+#define NR_OBJECTS 72
+
+static int ctor_calls;
+
+static void object_ctor(void *p) {
+    struct object *obj = p;
+    obj->magic = OBJECT_MAGIC;
+    obj->uses = 0;
+    ctor_calls++;
+}
+
+static struct object *objects[NR_OBJECTS];
+
+// Offset of the lowest object of `obj`'s page
+static usize first_offset(struct object *obj) {
+    usize first = PAGE_SIZE;
+    for (int i = 0; i < NR_OBJECTS; i++)
+        if (PAGE_BASE((u64)objects[i]) == PAGE_BASE((u64)obj))
+            first = MIN(first, (u64)objects[i] % PAGE_SIZE);
+    return first;
+}
+
+// Objects are constructed once, and slab pages start them at different
+// offsets
+static void cache_test() {
+    struct kmem_cache *cache =
+            kmem_cache_create("test", sizeof(struct object), OBJECT_ALIGN, object_ctor);
+    if (!cache)
+        FAIL("FAIL: kmem_cache_create()\n");
+    isize used = kalloc_page_count();
+
+    for (int i = 0; i < NR_OBJECTS; i++) {
+        struct object *obj = objects[i] = kmem_cache_alloc(cache);
+        if (!obj || (u64)obj % OBJECT_ALIGN ||
+            (u64)obj % PAGE_SIZE + sizeof(struct object) > PAGE_SIZE)
+            FAIL("FAIL: kmem_cache_alloc() = %p\n", obj);
+        if (obj->magic != OBJECT_MAGIC || obj->uses)
+            FAIL("FAIL: object %p not constructed\n", obj);
+        obj->uses++;
+        memset(obj->payload, i, sizeof(obj->payload));
+    }
+    if (ctor_calls != NR_OBJECTS)
+        FAIL("FAIL: %d objects, %d constructed\n", NR_OBJECTS, ctor_calls);
+
+    // Free blocks keep the object intact, the ctor does not run again
+    struct object *obj = objects[NR_OBJECTS / 2];
+    kmem_cache_free(cache, obj);
+    if (kmem_cache_alloc(cache) != obj || obj->magic != OBJECT_MAGIC || obj->uses != 1)
+        FAIL("FAIL: freed object %p not handed back as it was\n", obj);
+    if (ctor_calls != NR_OBJECTS)
+        FAIL("FAIL: reused object constructed again\n");
+
+    int colours = 0;
+    usize seen[NR_OBJECTS];
+    for (int i = 0; i < NR_OBJECTS; i++) {
+        for (int k = 0; k < (int)sizeof(objects[i]->payload); k++)
+            if (objects[i]->payload[k] != i)
+                FAIL("FAIL: object %d overwritten\n", i);
+        usize first = first_offset(objects[i]);
+        int c = 0;
+        while (c < colours && seen[c] != first)
+            c++;
+        if (c == colours)
+            seen[colours++] = first;
+    }
+    if (colours < 2)
+        FAIL("FAIL: all slab pages start at offset %llu\n", seen[0]);
+
+    for (int i = 0; i < NR_OBJECTS; i++)
+        kmem_cache_free(cache, objects[i]);
+    kmem_cache_reclaim();
+    if (kalloc_page_count() != used)
+        FAIL("FAIL: cache kept %lld pages\n", kalloc_page_count() - used);
+    printk("cache: %d objects, %d colours\n", NR_OBJECTS, colours);
+}
+
+// Runs on one CPU, the others may be anywhere
+void alloc_test() {
+    printk("alloc_test\n");
+    // Empty slab pages the tests before kept. Running out of blocks below
+    // gives them back, which would look like pages found.
+    kmem_cache_reclaim();
+    drain_page_caches();
+    isize used = kalloc_page_count();
+    orders_test();
+    merge_test();
+    large_test();
+    if (kalloc_page_count() != used)
+        FAIL("FAIL: %lld pages leaked\n", kalloc_page_count() - used);
+    // Last, as the cache stays
+    cache_test();
+    printk("alloc_test PASS\n");
+}
@@ -5,31 +5,29 @@
 #include <kernel/mem.h>
 #include <kernel/printk.h>
 #include <test/test.h>
-
-extern RefCount kalloc_page_cnt;
+#include <test/test_util.h>
 
 static RefCount x;
-static void *p[4][10000];
-static short sz[4][10000];
+static void *p[NCPU][10000];
+static short sz[NCPU][10000];
+// Start of the page and block phases, and their lengths in ticks
+static u64 t_pages, t_blocks;
 
-#define FAIL(...)            \
-    {                        \
-        printk(__VA_ARGS__); \
-        while (1);           \
-    }
-#define SYNC(i)              \
-    arch_dsb_sy();           \
-    increment_rc(&x);        \
-    while (x.count < 4 * i); \
+#define SYNC(i)                 \
+    arch_dsb_sy();              \
+    increment_rc(&x);           \
+    while (x.count < NCPU * i); \
     arch_dsb_sy();
 
 void kalloc_test() {
     int i = cpuid();
-    int r = kalloc_page_cnt.count;
+    int r = kalloc_page_count();
     int y = 10000 - i * 500;
     if (i == 0)
         printk("\n\nkalloc_test\n");
     SYNC(1)
+    if (i == 0)
+        t_pages = get_timestamp();
     for (int j = 0; j < y; j++) {
         p[i][j] = kalloc_page();
         if (!p[i][j] || ((u64)p[i][j] & 4095))
@@ -44,9 +42,13 @@ void kalloc_test() {
         kfree_page(p[i][j]);
     }
     SYNC(2)
-    if (kalloc_page_cnt.count != r)
-        FAIL("FAIL: kalloc_page_cnt %d -> %lld\n", r, kalloc_page_cnt.count);
+    if (i == 0)
+        t_pages = get_timestamp() - t_pages;
+    if (kalloc_page_count() != r)
+        FAIL("FAIL: kalloc_page_count %d -> %lld\n", r, kalloc_page_count());
     SYNC(3)
+    if (i == 0)
+        t_blocks = get_timestamp();
     for (int j = 0; j < 10000;) {
         if (j < 1000 || rand() > RAND_MAX / 16 * 7) {
             int z = 0;
@@ -90,16 +92,22 @@ void kalloc_test() {
     }
     SYNC(4)
     if (cpuid() == 0) {
+        t_blocks = get_timestamp() - t_blocks;
+        u64 freq = get_clock_frequency();
+        printk("Pages: %llu us\nBlocks: %llu us\n", t_pages * 1000000 / freq,
+               t_blocks * 1000000 / freq);
         i64 z = 0;
-        for (int j = 0; j < 4; j++)
+        for (int j = 0; j < NCPU; j++)
             for (int k = 0; k < 10000; k++)
                 z += sz[j][k];
-        printk("Total: %lld\nUsage: %lld\n", z, kalloc_page_cnt.count - r);
+        printk("Total: %lld\nUsage: %lld\n", z, kalloc_page_count() - r);
     }
     SYNC(5)
     for (int j = 0; j < 10000; j++)
         kfree(p[i][j]);
     SYNC(6)
-    if (cpuid() == 0)
+    if (cpuid() == 0) {
+        kalloc_stats();
         printk("kalloc_test PASS\n");
+    }
 }
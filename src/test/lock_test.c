@@ -0,0 +1,93 @@
+#include <aarch64/intrinsic.h>
+#include <common/spinlock.h>
+#include <kernel/printk.h>
+#include <test/test.h>
+#include <test/test_util.h>
+
+#define ROUNDS 20000
+
+// The test-and-set lock SpinLock used to be, as the baseline
+typedef struct {
+    volatile bool locked;
+} TasLock;
+
+static void tas_acquire(void *p) {
+    TasLock *lock = p;
+    while (lock->locked || __atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE))
+        arch_yield();
+}
+
+static void tas_release(void *p) {
+    __atomic_clear(&((TasLock *)p)->locked, __ATOMIC_RELEASE);
+}
+
+static void ticket_acquire(void *p) {
+    acquire_spinlock(p);
+}
+
+static void ticket_release(void *p) {
+    release_spinlock(p);
+}
+
+// Shared state, only touched with the lock held
+static volatile u64 counter;
+static volatile int last_cpu;
+static volatile u64 released_at;
+
+static u64 handoffs[NCPU], handoff_ticks[NCPU];
+static u64 start, end;
+
+static void bench(const char *name, void (*acquire)(void *), void (*release)(void *),
+                  void *lock, int *phase) {
+    int i = cpuid();
+    if (i == 0) {
+        counter = 0;
+        last_cpu = -1;
+    }
+    handoffs[i] = handoff_ticks[i] = 0;
+    barrier(++*phase);
+    if (i == 0)
+        start = get_timestamp();
+    for (int j = 0; j < ROUNDS; j++) {
+        acquire(lock);
+        // Time from the previous holder letting go to us getting in
+        if (last_cpu != i && last_cpu != -1) {
+            handoffs[i]++;
+            handoff_ticks[i] += get_timestamp() - released_at;
+        }
+        counter++;
+        last_cpu = i;
+        released_at = get_timestamp();
+        release(lock);
+    }
+    barrier(++*phase);
+    if (i == 0) {
+        end = get_timestamp();
+        if (counter != NCPU * ROUNDS)
+            FAIL("FAIL: %s lost updates, counter %llu\n", name, counter);
+        u64 n = 0, ticks = 0;
+        for (int k = 0; k < NCPU; k++) {
+            n += handoffs[k];
+            ticks += handoff_ticks[k];
+        }
+        u64 freq = get_clock_frequency();
+        printk("%s: %d acquisitions in %llu us, %llu handoffs, %llu ns per handoff\n",
+               name, NCPU * ROUNDS, (end - start) * 1000000 / freq, n,
+               n ? ticks * 1000000000 / freq / n : 0);
+    }
+}
+
+void lock_test() {
+    static TasLock tas;
+    static SpinLock ticket;
+    int phase = 0;
+    if (cpuid() == 0) {
+        printk("\n\nlock_test\n");
+        init_spinlock(&ticket);
+    }
+    bench("test-and-set", tas_acquire, tas_release, &tas, &phase);
+    bench("ticket", ticket_acquire, ticket_release, &ticket, &phase);
+    barrier(++phase);
+    if (cpuid() == 0)
+        printk("lock_test PASS\n");
+}
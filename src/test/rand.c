@@ -1,16 +1,32 @@
 #include <aarch64/intrinsic.h>
 #include <common/defines.h>
+#include <common/spinlock.h>
+#include <kernel/percpu.h>
 
-static u64 next[4] = { 1111, 2222, 3333, 4444 };
+static DEFINE_PER_CPU(u64, next);
+// False until srand() or the first rand(), which seeds every CPU differently
+static DEFINE_PER_CPU(bool, seeded);
 
 unsigned rand(void)
 {
+    // A thread moved halfway would update another CPU's state
+    push_off();
+    u64 *n = this_cpu_ptr(next);
+    if (!this_cpu(seeded)) {
+        *n = 1111 * (cpuid() + 1);
+        this_cpu(seeded) = true;
+    }
     // RAND_MAX assumed to be 32767
-    next[cpuid()] = next[cpuid()] * 1103515245 + 12345;
-    return (unsigned int)(next[cpuid()] / 65536) % 32768;
+    *n = *n * 1103515245 + 12345;
+    unsigned r = (unsigned int)(*n / 65536) % 32768;
+    pop_off();
+    return r;
 }
 
 void srand(unsigned seed)
 {
-    next[cpuid()] = seed;
-}
\ No newline at end of file
+    push_off();
+    this_cpu(next) = seed;
+    this_cpu(seeded) = true;
+    pop_off();
+}
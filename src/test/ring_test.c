@@ -0,0 +1,97 @@
+#include <aarch64/intrinsic.h>
+#include <common/ring.h>
+#include <kernel/printk.h>
+#include <test/test.h>
+#include <test/test_util.h>
+
+#define ITEMS 20000
+
+static MPMCSlot mpmc_slots[256];
+static MPMCRing mpmc;
+// One ring for every pair of CPUs
+static void *spsc_data[NCPU / 2][64];
+static SPSCRing spsc[NCPU / 2];
+
+static volatile u64 popped, popped_sum, full;
+
+// Element `j` of CPU `i`, never NULL
+#define ITEM(i, j) ((void *)((u64)((i) + 1) << 32 | (j)))
+
+static void take(u64 *last) {
+    void *p;
+    if (!mpmc_ring_pop(&mpmc, &p))
+        return;
+    int from = ((u64)p >> 32) - 1;
+    u64 j = (u64)p & 0xffffffff;
+    if (from < 0 || from >= NCPU || j >= ITEMS)
+        FAIL("FAIL: popped garbage %p\n", p);
+    // Elements of one producer must come out in order
+    if (last[from] != (u64)-1 && j <= last[from])
+        FAIL("FAIL: CPU %lld popped %llu from CPU %d after %llu\n", cpuid(), j, from,
+             last[from]);
+    last[from] = j;
+    __atomic_add_fetch(&popped_sum, j, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&popped, 1, __ATOMIC_RELAXED);
+}
+
+static void check_mpmc() {
+    int i = cpuid();
+    u64 last[NCPU];
+    for (int k = 0; k < NCPU; k++)
+        last[k] = -1;
+    for (int j = 0; j < ITEMS;) {
+        if (mpmc_ring_push(&mpmc, ITEM(i, j)))
+            j++;
+        else
+            __atomic_add_fetch(&full, 1, __ATOMIC_RELAXED);
+        take(last);
+    }
+    while (popped < NCPU * ITEMS)
+        take(last);
+}
+
+static void check_spsc() {
+    int i = cpuid();
+    // Left out if NCPU is odd
+    if (i / 2 >= NCPU / 2)
+        return;
+    SPSCRing *ring = &spsc[i / 2];
+    if (i % 2 == 0) {
+        for (int j = 0; j < ITEMS;)
+            if (spsc_ring_push(ring, ITEM(i, j)))
+                j++;
+    } else {
+        for (int j = 0; j < ITEMS;) {
+            void *p;
+            if (!spsc_ring_pop(ring, &p))
+                continue;
+            if (p != ITEM(i - 1, j))
+                FAIL("FAIL: CPU %d expected %p, popped %p\n", i, ITEM(i - 1, j), p);
+            j++;
+        }
+    }
+}
+
+void ring_test() {
+    int phase = 0;
+    if (cpuid() == 0) {
+        printk("\n\nring_test\n");
+        init_mpmc_ring(&mpmc, mpmc_slots, 256);
+        for (int k = 0; k < NCPU / 2; k++)
+            init_spsc_ring(&spsc[k], spsc_data[k], 64);
+    }
+    barrier(++phase);
+    check_mpmc();
+    barrier(++phase);
+    if (cpuid() == 0) {
+        void *p;
+        u64 sum = NCPU * ((u64)ITEMS * (ITEMS - 1) / 2);
+        if (popped != NCPU * ITEMS || popped_sum != sum || mpmc_ring_pop(&mpmc, &p))
+            FAIL("FAIL: mpmc popped %llu, sum %llu\n", popped, popped_sum);
+        printk("mpmc: %llu elements, ring full %llu times\n", popped, full);
+    }
+    check_spsc();
+    barrier(++phase);
+    if (cpuid() == 0)
+        printk("ring_test PASS\n");
+}
@@ -0,0 +1,112 @@
+#include <aarch64/intrinsic.h>
+#include <common/rwlock.h>
+#include <common/seqlock.h>
+#include <kernel/printk.h>
+#include <test/test.h>
+#include <test/test_util.h>
+
+#define ROUNDS 20000
+#define SLOTS 8
+
+static RWLock rwlock;
+static SeqLock seqlock;
+// Every write stores the same value in all slots
+static volatile u64 data[SLOTS];
+static volatile int readers_in, writers_in;
+static u64 reads[NCPU], writes[NCPU], retries[NCPU];
+
+static void write_all(u64 v) {
+    for (int k = 0; k < SLOTS; k++)
+        data[k] = v;
+}
+
+static void check_rwlock() {
+    int i = cpuid();
+    for (int j = 0; j < ROUNDS; j++) {
+        if (rand() % 8 == 0) {
+            acquire_rwlock_write(&rwlock);
+            if (__atomic_add_fetch(&writers_in, 1, __ATOMIC_SEQ_CST) != 1 || readers_in)
+                FAIL("FAIL: writer on CPU %d not alone\n", i);
+            write_all((u64)i << 32 | j);
+            __atomic_sub_fetch(&writers_in, 1, __ATOMIC_SEQ_CST);
+            release_rwlock_write(&rwlock);
+            writes[i]++;
+        } else {
+            acquire_rwlock_read(&rwlock);
+            __atomic_add_fetch(&readers_in, 1, __ATOMIC_SEQ_CST);
+            if (writers_in)
+                FAIL("FAIL: reader on CPU %d next to a writer\n", i);
+            for (int k = 1; k < SLOTS; k++)
+                if (data[k] != data[0])
+                    FAIL("FAIL: reader on CPU %d saw a partial write\n", i);
+            __atomic_sub_fetch(&readers_in, 1, __ATOMIC_SEQ_CST);
+            release_rwlock_read(&rwlock);
+            reads[i]++;
+        }
+    }
+}
+
+static void check_seqlock() {
+    int i = cpuid();
+    u64 copy[SLOTS];
+    for (int j = 0; j < ROUNDS; j++) {
+        if (rand() % 8 == 0) {
+            write_seqlock(&seqlock);
+            write_all((u64)i << 32 | j);
+            write_sequnlock(&seqlock);
+            writes[i]++;
+        } else {
+            u32 seq;
+            for (;;) {
+                seq = read_seqbegin(&seqlock);
+                for (int k = 0; k < SLOTS; k++)
+                    copy[k] = data[k];
+                if (!read_seqretry(&seqlock, seq))
+                    break;
+                retries[i]++;
+            }
+            for (int k = 1; k < SLOTS; k++)
+                if (copy[k] != copy[0])
+                    FAIL("FAIL: seqlock reader on CPU %d kept a torn copy\n", i);
+            reads[i]++;
+        }
+    }
+}
+
+static void report(const char *name, bool with_retries) {
+    u64 r = 0, w = 0, t = 0;
+    for (int k = 0; k < NCPU; k++) {
+        r += reads[k];
+        w += writes[k];
+        t += retries[k];
+        reads[k] = writes[k] = retries[k] = 0;
+    }
+    if (r + w != NCPU * ROUNDS)
+        FAIL("FAIL: %s ran %llu rounds\n", name, r + w);
+    if (with_retries)
+        printk("%s: %llu reads, %llu writes, %llu retries\n", name, r, w, t);
+    else
+        printk("%s: %llu reads, %llu writes\n", name, r, w);
+}
+
+void rwlock_test() {
+    int phase = 0;
+    if (cpuid() == 0) {
+        printk("\n\nrwlock_test\n");
+        init_rwlock(&rwlock);
+        init_seqlock(&seqlock);
+        write_all(0);
+    }
+    barrier(++phase);
+    check_rwlock();
+    barrier(++phase);
+    if (cpuid() == 0)
+        report("rwlock", false);
+    barrier(++phase);
+    check_seqlock();
+    barrier(++phase);
+    if (cpuid() == 0) {
+        report("seqlock", true);
+        printk("rwlock_test PASS\n");
+    }
+}
@@ -0,0 +1,44 @@
+#include <aarch64/intrinsic.h>
+#include <kernel/printk.h>
+#include <kernel/sched.h>
+#include <test/test.h>
+#include <test/test_util.h>
+
+// More than there are CPUs
+#define NR_WORKERS 12
+
+static volatile int started, finished;
+// CPUs the workers ran on, one bit each
+static volatile u32 ran_on;
+
+static void mark_cpu() {
+    u32 bit = 1u << cpuid();
+    if (!(ran_on & bit))
+        __atomic_fetch_or(&ran_on, bit, __ATOMIC_RELAXED);
+}
+
+static void worker(u64 id) {
+    (void)id;
+    __atomic_fetch_add(&started, 1, __ATOMIC_SEQ_CST);
+    // No worker finishes before all have started, which takes preemption
+    while (started < NR_WORKERS)
+        mark_cpu();
+    mark_cpu();
+    __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+}
+
+void sched_test() {
+    printk("\n\nsched_test\n");
+    u64 start = get_timestamp();
+    // All queued on this CPU, the others have to steal them
+    for (int i = 0; i < NR_WORKERS; i++)
+        if (!create_thread(worker, i))
+            FAIL("FAIL: create_thread\n");
+    while (finished < NR_WORKERS)
+        yield();
+    if (ran_on != (1u << NCPU) - 1)
+        FAIL("FAIL: workers only ran on CPUs %x\n", ran_on);
+    printk("%d threads on CPUs %x in %llu us\n", NR_WORKERS, ran_on,
+           (get_timestamp() - start) * 1000000 / get_clock_frequency());
+    printk("sched_test PASS\n");
+}
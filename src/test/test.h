@@ -1,7 +1,16 @@
 #pragma once
 
+#include <common/defines.h>
+
 #define RAND_MAX 32768
 
 void kalloc_test();
+void alloc_test();
+void lock_test();
+void rwlock_test();
+void ring_test();
+void sched_test();
+void timer_test();
+void vm_test();
 unsigned rand();
 void srand(unsigned seed);
\ No newline at end of file
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <aarch64/intrinsic.h>
+#include <kernel/printk.h>
+
+// Report a failed check and stop here
+#define FAIL(...)            \
+    {                        \
+        printk(__VA_ARGS__); \
+        while (1);           \
+    }
+
+// Wait for all CPUs, `n` counts the barriers the calling test has passed
+// so far. Every test file has a count of its own.
+static INLINE void barrier(int n) {
+    static volatile int arrived;
+    arch_dsb_sy();
+    __atomic_fetch_add(&arrived, 1, __ATOMIC_SEQ_CST);
+    while (arrived < NCPU * n);
+    arch_dsb_sy();
+}
@@ -0,0 +1,47 @@
+#include <aarch64/intrinsic.h>
+#include <kernel/printk.h>
+#include <kernel/sched.h>
+#include <kernel/timer.h>
+#include <test/test.h>
+#include <test/test_util.h>
+
+#define NR_SLEEPERS 8
+#define ROUNDS 20
+
+static volatile int finished;
+// Worst time from a deadline to the thread running again, in ticks
+static volatile u64 max_late;
+
+static void sleeper(u64 id) {
+    // Different periods, so that the heaps always hold several deadlines
+    u64 period = us_to_ticks(200 * (id + 1));
+    for (int i = 0; i < ROUNDS; i++) {
+        u64 deadline = get_timestamp() + period;
+        sleep_until(deadline);
+        u64 now = get_timestamp();
+        if (now < deadline)
+            FAIL("FAIL: thread %llu woke up %llu ticks early\n", id, deadline - now);
+        u64 late = now - deadline, seen = max_late;
+        while (late > seen &&
+               !__atomic_compare_exchange_n(&max_late, &seen, late, false,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+    __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+}
+
+void timer_test() {
+    printk("\n\ntimer_test\n");
+    u64 start = get_timestamp();
+    for (int i = 0; i < NR_SLEEPERS; i++)
+        if (!create_thread(sleeper, i))
+            FAIL("FAIL: create_thread\n");
+    // Sleeps too, through delay_us()
+    while (finished < NR_SLEEPERS)
+        delay_us(1000);
+    u64 freq = get_clock_frequency();
+    printk("%d threads slept %d times in %llu us, at most %llu us late\n",
+           NR_SLEEPERS, ROUNDS, (get_timestamp() - start) * 1000000 / freq,
+           max_late * 1000000 / freq);
+    printk("timer_test PASS\n");
+}
@@ -0,0 +1,318 @@
+#include <aarch64/intrinsic.h>
+#include <aarch64/mmu.h>
+#include <common/string.h>
+#include <kernel/mem.h>
+#include <kernel/printk.h>
+#include <kernel/pt.h>
+#include <test/test.h>
+#include <test/test_util.h>
+
+// User addresses the test maps, far apart so they need tables of their own
+#define VA_A 0x400000ull
+#define VA_B 0x8000000000ull
+
+// Kernel address of the page mapped at `va`, or NULL
+static u8 *page_at(struct pgdir *pgdir, u64 va) {
+    PTEntriesPtr pte = get_pte(pgdir, va, false);
+    if (!pte || !(*pte & PTE_VALID))
+        return NULL;
+    return (u8 *)P2K(PTE_ADDRESS(*pte));
+}
+
+static void *alloc_filled(u8 fill) {
+    void *page = kalloc_page();
+    if (!page)
+        FAIL("FAIL: kalloc_page()\n");
+    memset(page, fill, PAGE_SIZE);
+    return page;
+}
+
+// Map, read and unmap, and the references the mappings hold
+static void map_test() {
+    struct pgdir pgdir;
+    init_pgdir(&pgdir);
+    u8 *a = alloc_filled(0xa5), *b = alloc_filled(0x5a);
+
+    if (!pgdir_map(&pgdir, VA_A, K2P(a), PAGE_SIZE, PTE_USER_DATA) ||
+        !pgdir_map(&pgdir, VA_B, K2P(b), PAGE_SIZE, PTE_USER_DATA))
+        FAIL("FAIL: pgdir_map()\n");
+    if (page_at(&pgdir, VA_A) != a || page_at(&pgdir, VA_B + 123) != b)
+        FAIL("FAIL: mapped %p %p, found %p %p\n", a, b, page_at(&pgdir, VA_A),
+             page_at(&pgdir, VA_B));
+    if (page_at(&pgdir, VA_A + PAGE_SIZE) || page_at(&pgdir, VA_B - PAGE_SIZE))
+        FAIL("FAIL: found a page next to the mappings\n");
+    if (page_at(&pgdir, VA_A)[100] != 0xa5 || page_at(&pgdir, VA_B)[100] != 0x5a)
+        FAIL("FAIL: read the wrong data through the mappings\n");
+    if (page_refcount(a) != 2 || page_refcount(b) != 2)
+        FAIL("FAIL: mapped pages have %u and %u references\n", page_refcount(a),
+             page_refcount(b));
+
+    // Replacing a mapping drops the reference of the page it replaces
+    if (!pgdir_map(&pgdir, VA_A, K2P(b), PAGE_SIZE, PTE_USER_DATA))
+        FAIL("FAIL: pgdir_map()\n");
+    if (page_at(&pgdir, VA_A) != b || page_refcount(a) != 1 || page_refcount(b) != 3)
+        FAIL("FAIL: replaced mapping has %u and %u references\n", page_refcount(a),
+             page_refcount(b));
+
+    pgdir_unmap(&pgdir, VA_A, PAGE_SIZE);
+    if (page_at(&pgdir, VA_A) || page_at(&pgdir, VA_B) != b)
+        FAIL("FAIL: pgdir_unmap() removed the wrong pages\n");
+    if (page_refcount(b) != 2)
+        FAIL("FAIL: unmapped page has %u references\n", page_refcount(b));
+
+    // Tearing down drops the rest, the tables go back to the allocator
+    free_pgdir(&pgdir);
+    if (page_refcount(b) != 1)
+        FAIL("FAIL: page of a freed pgdir has %u references\n", page_refcount(b));
+    kfree_page(a);
+    kfree_page(b);
+}
+
+// More pages than one gather holds, so an unmap flushes on the way
+#define NR_GATHER (2 * TLB_GATHER_PAGES + 3)
+
+static void *gathered[NR_GATHER];
+
+// Unmapping in batches drops every reference, once the TLB is flushed
+static void gather_test() {
+    struct pgdir pgdir;
+    init_pgdir(&pgdir);
+    for (int i = 0; i < NR_GATHER; i++) {
+        gathered[i] = alloc_filled(i);
+        if (!pgdir_map(&pgdir, VA_A + i * PAGE_SIZE, K2P(gathered[i]), PAGE_SIZE,
+                       PTE_USER_DATA))
+            FAIL("FAIL: pgdir_map()\n");
+    }
+    // With an ASID, the flushes have TLB entries to go after
+    attach_pgdir(&pgdir);
+
+    // A hole first, then the rest around it
+    pgdir_unmap(&pgdir, VA_A + PAGE_SIZE, PAGE_SIZE);
+    if (page_refcount(gathered[1]) != 1 || page_refcount(gathered[0]) != 2)
+        FAIL("FAIL: unmapped one page, references %u and %u\n",
+             page_refcount(gathered[1]), page_refcount(gathered[0]));
+    pgdir_unmap(&pgdir, VA_A, NR_GATHER * PAGE_SIZE);
+    for (int i = 0; i < NR_GATHER; i++) {
+        if (page_at(&pgdir, VA_A + i * PAGE_SIZE))
+            FAIL("FAIL: page %d still mapped\n", i);
+        if (page_refcount(gathered[i]) != 1)
+            FAIL("FAIL: unmapped page %d has %u references\n", i,
+                 page_refcount(gathered[i]));
+    }
+
+    // Pages handed to a gather directly are held until the flush
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb, &pgdir);
+    for (int i = 0; i < NR_GATHER; i++) {
+        get_page(gathered[i]);
+        tlb_gather_page(&tlb, VA_A + i * PAGE_SIZE);
+        tlb_gather_free(&tlb, gathered[i]);
+    }
+    if (page_refcount(gathered[NR_GATHER - 1]) != 2)
+        FAIL("FAIL: gathered page dropped before the flush\n");
+    tlb_flush(&tlb);
+    for (int i = 0; i < NR_GATHER; i++) {
+        if (page_refcount(gathered[i]) != 1)
+            FAIL("FAIL: gathered page %d has %u references\n", i,
+                 page_refcount(gathered[i]));
+        kfree_page(gathered[i]);
+    }
+
+    attach_pgdir(NULL);
+    free_pgdir(&pgdir);
+}
+
+// Entry of `va`, which must be mapped
+static PTEntry pte_at(struct pgdir *pgdir, u64 va) {
+    PTEntriesPtr pte = get_pte(pgdir, va, false);
+    if (!pte || !(*pte & PTE_VALID))
+        FAIL("FAIL: %llx is not mapped\n", va);
+    return *pte;
+}
+
+// Copies share pages until one side writes, read-only pages for good
+static void cow_test() {
+    struct pgdir a, b;
+    init_pgdir(&a);
+    init_pgdir(&b);
+    u8 *data = alloc_filled(0x11), *ro = alloc_filled(0x22);
+    if (!pgdir_map(&a, VA_A, K2P(data), PAGE_SIZE, PTE_USER_DATA) ||
+        !pgdir_map(&a, VA_B, K2P(ro), PAGE_SIZE, PTE_USER_DATA | PTE_RO))
+        FAIL("FAIL: pgdir_map()\n");
+
+    if (!pgdir_copy(&b, &a))
+        FAIL("FAIL: pgdir_copy()\n");
+    if (page_at(&b, VA_A) != data || page_at(&b, VA_B) != ro)
+        FAIL("FAIL: copy maps other pages\n");
+    if (page_refcount(data) != 3 || page_refcount(ro) != 3)
+        FAIL("FAIL: shared pages have %u and %u references\n", page_refcount(data),
+             page_refcount(ro));
+    struct pgdir *sharers[] = {&a, &b};
+    for (int i = 0; i < 2; i++) {
+        struct pgdir *p = sharers[i];
+        if ((pte_at(p, VA_A) & (PTE_RO | PTE_COW)) != (PTE_RO | PTE_COW))
+            FAIL("FAIL: shared page is not copy-on-write\n");
+        if (pte_at(p, VA_B) & PTE_COW)
+            FAIL("FAIL: read-only page turned copy-on-write\n");
+    }
+
+    // The first writer gets a copy of its own
+    if (!pgdir_cow_fault(&b, VA_A))
+        FAIL("FAIL: pgdir_cow_fault() on a shared page\n");
+    u8 *copy = page_at(&b, VA_A);
+    if (copy == data || (pte_at(&b, VA_A) & (PTE_RO | PTE_COW)))
+        FAIL("FAIL: writer did not get a writable copy\n");
+    if (page_refcount(data) != 2 || page_refcount(copy) != 1)
+        FAIL("FAIL: after the copy, references %u and %u\n", page_refcount(data),
+             page_refcount(copy));
+    if (copy[PAGE_SIZE - 1] != 0x11)
+        FAIL("FAIL: copy has %x\n", copy[PAGE_SIZE - 1]);
+    copy[0] = 0x33;
+    if (data[0] != 0x11)
+        FAIL("FAIL: write to the copy reached the original\n");
+    if (pgdir_cow_fault(&b, VA_B))
+        FAIL("FAIL: pgdir_cow_fault() on a read-only page\n");
+
+    // The last one left keeps the page, with nothing to copy
+    kfree_page(data);
+    if (!pgdir_cow_fault(&a, VA_A))
+        FAIL("FAIL: pgdir_cow_fault() on a page no longer shared\n");
+    if (page_at(&a, VA_A) != data || (pte_at(&a, VA_A) & (PTE_RO | PTE_COW)))
+        FAIL("FAIL: sole owner did not keep the page writable\n");
+    if (page_refcount(data) != 1)
+        FAIL("FAIL: sole owner has %u references\n", page_refcount(data));
+
+    free_pgdir(&b);
+    if (page_refcount(ro) != 2)
+        FAIL("FAIL: after one teardown, %u references\n", page_refcount(ro));
+    get_page(data);
+    free_pgdir(&a);
+    if (page_refcount(ro) != 1 || page_refcount(data) != 1)
+        FAIL("FAIL: after both teardowns, references %u and %u\n",
+             page_refcount(ro), page_refcount(data));
+    kfree_page(data);
+    kfree_page(ro);
+}
+
+static bool zeroed(u8 *page) {
+    for (int i = 0; i < PAGE_SIZE; i++)
+        if (page[i])
+            return false;
+    return true;
+}
+
+// Anonymous regions are filled in on the first touch, with zeroes
+static void anon_test() {
+    struct pgdir a, b;
+    init_pgdir(&a);
+    init_pgdir(&b);
+    // Leave garbage behind for the next allocation to find
+    kfree_page(alloc_filled(0xff));
+
+    if (!pgdir_add_anon(&a, VA_A, 4 * PAGE_SIZE, PTE_USER_DATA) ||
+        !pgdir_add_anon(&a, VA_B, 2 * PAGE_SIZE, PTE_USER_DATA | PTE_RO))
+        FAIL("FAIL: pgdir_add_anon()\n");
+    if (pgdir_add_anon(&a, VA_A + 3 * PAGE_SIZE, 2 * PAGE_SIZE, PTE_USER_DATA))
+        FAIL("FAIL: overlapping regions added\n");
+    if (page_at(&a, VA_A) || page_at(&a, VA_B))
+        FAIL("FAIL: regions mapped up front\n");
+    if (pgdir_handle_fault(&a, VA_A - PAGE_SIZE, false) ||
+        pgdir_handle_fault(&a, VA_B + 2 * PAGE_SIZE, true))
+        FAIL("FAIL: fault outside the regions resolved\n");
+
+    // A write gets a zeroed page of its own
+    if (!pgdir_handle_fault(&a, VA_A + 8, true))
+        FAIL("FAIL: write fault in an anonymous region\n");
+    u8 *page = page_at(&a, VA_A);
+    if (!page || !zeroed(page) || (pte_at(&a, VA_A) & (PTE_RO | PTE_COW)))
+        FAIL("FAIL: write fault did not map a writable zeroed page\n");
+
+    // Reads share the zero page until written
+    if (!pgdir_handle_fault(&a, VA_A + PAGE_SIZE, false) ||
+        !pgdir_handle_fault(&a, VA_A + 2 * PAGE_SIZE, false))
+        FAIL("FAIL: read fault in an anonymous region\n");
+    u8 *zero = page_at(&a, VA_A + PAGE_SIZE);
+    if (!zero || zero != page_at(&a, VA_A + 2 * PAGE_SIZE) || !zeroed(zero))
+        FAIL("FAIL: reads did not share the zero page\n");
+    if ((pte_at(&a, VA_A + PAGE_SIZE) & (PTE_RO | PTE_COW)) != (PTE_RO | PTE_COW))
+        FAIL("FAIL: zero page is not copy-on-write\n");
+    if (!pgdir_handle_fault(&a, VA_A + PAGE_SIZE, true))
+        FAIL("FAIL: write fault on the zero page\n");
+    page = page_at(&a, VA_A + PAGE_SIZE);
+    if (page == zero || !zeroed(page) || (pte_at(&a, VA_A + PAGE_SIZE) & PTE_RO))
+        FAIL("FAIL: write to the zero page did not get a page of its own\n");
+    memset(page, 0x44, PAGE_SIZE);
+    if (!zeroed(zero))
+        FAIL("FAIL: zero page was written\n");
+
+    // Read-only regions can be read, never written
+    if (pgdir_handle_fault(&a, VA_B, true) || page_at(&a, VA_B))
+        FAIL("FAIL: write fault in a read-only region resolved\n");
+    if (!pgdir_handle_fault(&a, VA_B, false))
+        FAIL("FAIL: read fault in a read-only region\n");
+    if (page_at(&a, VA_B) != zero || (pte_at(&a, VA_B) & PTE_COW))
+        FAIL("FAIL: read-only region mapped copy-on-write\n");
+    if (pgdir_handle_fault(&a, VA_B, true))
+        FAIL("FAIL: write to a read-only zero page resolved\n");
+
+    // Copies take the regions along, still lazy
+    if (!pgdir_copy(&b, &a))
+        FAIL("FAIL: pgdir_copy()\n");
+    if (page_at(&b, VA_A + 3 * PAGE_SIZE) || page_at(&b, VA_B + PAGE_SIZE))
+        FAIL("FAIL: copy mapped untouched pages\n");
+    if (!pgdir_handle_fault(&b, VA_A + 3 * PAGE_SIZE, true) ||
+        pgdir_handle_fault(&b, VA_B + PAGE_SIZE, true))
+        FAIL("FAIL: copied regions lost their flags\n");
+    if (!pgdir_handle_fault(&b, VA_A + PAGE_SIZE, true) ||
+        page_at(&b, VA_A + PAGE_SIZE)[0] != 0x44)
+        FAIL("FAIL: copy lost written data\n");
+
+    free_pgdir(&b);
+    free_pgdir(&a);
+}
+
+// Address spaces that are attached get ASIDs of their own
+static void asid_test() {
+    struct pgdir x, y;
+    init_pgdir(&x);
+    init_pgdir(&y);
+    u8 *a = alloc_filled(0);
+    if (!pgdir_map(&x, VA_A, K2P(a), PAGE_SIZE, PTE_USER_DATA) ||
+        !pgdir_map(&y, VA_A, K2P(a), PAGE_SIZE, PTE_USER_DATA))
+        FAIL("FAIL: pgdir_map()\n");
+
+    attach_pgdir(&x);
+    if (current_pgdir() != &x || !(x.asid & 0xffff))
+        FAIL("FAIL: attached pgdir has ASID %llx\n", x.asid);
+    attach_pgdir(&y);
+    if (current_pgdir() != &y || (x.asid & 0xffff) == (y.asid & 0xffff))
+        FAIL("FAIL: pgdirs share ASID %llx\n", y.asid);
+    // Coming back keeps the ASID of the same generation
+    u64 asid = x.asid;
+    attach_pgdir(&x);
+    if (x.asid != asid)
+        FAIL("FAIL: ASID changed from %llx to %llx\n", asid, x.asid);
+    attach_pgdir(NULL);
+    if (current_pgdir())
+        FAIL("FAIL: detached, yet %p is attached\n", current_pgdir());
+
+    free_pgdir(&x);
+    free_pgdir(&y);
+    kfree_page(a);
+}
+
+// Runs on one CPU, the others may be anywhere
+void vm_test() {
+    printk("vm_test\n");
+    // The region structs come from a slab that may keep its page around
+    kfree(kalloc(sizeof(struct anon_region)));
+    isize used = kalloc_page_count();
+    map_test();
+    asid_test();
+    gather_test();
+    cow_test();
+    anon_test();
+    if (kalloc_page_count() != used)
+        FAIL("FAIL: %lld pages leaked\n", kalloc_page_count() - used);
+    printk("vm_test PASS\n");
+}